@@ -5,6 +5,7 @@
 #include <cstdio>
 #include <memory>
 #include <string>
+#include <vector>
 
 using AudioInputCallBack = void (*)(const int16_t *input_data, unsigned int chan_num, unsigned int frame_num,
                                     void *user_data);
@@ -26,11 +27,77 @@ enum class AudioPeriodSize : int
   INR_40MS = 0x28
 };
 
+enum class AudioEncoderApplication : int
+{
+  VoIP,
+  Audio,
+  RestrictedLowDelay
+};
+
+enum class AudioEncoderSignal : int
+{
+  Auto,
+  Voice,
+  Music
+};
+
+struct AudioEncoderProfile
+{
+  AudioEncoderApplication application = AudioEncoderApplication::Audio;
+  // bits per second, 0 leaves the choice to the encoder.
+  int bitrate = 0;
+  bool vbr = true;
+  // 0 ~ 10, lower values trade quality for cpu.
+  int complexity = 10;
+  bool inband_fec = false;
+  int packet_loss_perc = 0;
+  bool dtx = false;
+  AudioEncoderSignal signal = AudioEncoderSignal::Auto;
+  // periods quieter than silence_threshold (dBFS) are not sent once the hangover has passed.
+  bool silence_gate = false;
+  int silence_threshold = -55;
+  // ms of deep redundancy (up to 1000) carried by every packet for burst loss recovery, 0 disables.
+  // needs a build with AUDIO_DRED, receivers decode it with OAStream::set_deep_redundancy.
+  // the encoder only spends bits on it while expecting loss, packet_loss_perc is raised to at least 5.
+  int dred_duration = 0;
+  // audio carried by one packet in ms: 5, 10, 20, 40, 60, 80, 100 or 120, independent of the capture period.
+  // 0 sends one packet per capture period. longer packets cut the packet rate at the cost of latency.
+  int packet_ms = 0;
+  // 8-byte header instead of 16, only understood by receivers that know the compact format.
+  bool compact_header = false;
+};
+
+enum class AudioSchedPolicy : int
+{
+  Default,
+  RoundRobin,
+  Fifo
+};
+
+struct AudioExecutorConfig
+{
+  int threads = 2;
+  // cpus the threads are pinned to, empty leaves the placement to the os.
+  std::vector<int> cpus;
+  AudioSchedPolicy policy = AudioSchedPolicy::RoundRobin;
+  int priority = 10;
+};
+
+struct AudioServiceConfig
+{
+  // timers, sockets and decoding on the audio path.
+  AudioExecutorConfig realtime;
+  // file access and device restarts. name resolution in connect() stays on the calling thread.
+  AudioExecutorConfig bulk = {1, {}, AudioSchedPolicy::Default, 0};
+};
+
 class OAStreamImpl;
 class IAStreamImpl;
 class AudioPlayerImpl;
+class AudioOfflineRenderImpl;
+class AudioRelayImpl;
 
-void start_audio_service();
+void start_audio_service(const AudioServiceConfig &config = AudioServiceConfig());
 
 void stop_audio_service();
 
@@ -38,8 +105,10 @@ class OAStream
 {
   friend class IAStream;
   friend class AudioPlayer;
+  friend class AudioOfflineRender;
 
 public:
+  // _hw_name "null" mixes on the service clock without a sound card.
   OAStream(unsigned char _token, const std::string &_hw_name = "default_output",
            AudioBandWidth _bandwidth = AudioBandWidth::Unknown, AudioPeriodSize _period = AudioPeriodSize::INR_10MS,
            bool _enable_network = false);
@@ -47,27 +116,60 @@ public:
 
   bool start();
 
+  // mutes the sender with this token, packets tagged by set_source_id() are not affected.
   void mute(unsigned char _token);
 
   void unmute(unsigned char _token);
 
+  // mutes the sender tagged with this source id by set_source_id().
+  void mute_source(uint32_t source_id);
+
+  void unmute_source(uint32_t source_id);
+
   void stop();
 
   void direct_push_pcm(uint8_t input_token, uint8_t input_chan, int input_period, int sample_rate,
                        const int16_t *data);
 
+  // mix only the n loudest sessions, the others are decoded sparsely. 0 mixes everything.
+  void set_active_speakers(int n);
+
+  // sessions silent for idle_timeout_ms are released, 0 keeps them forever.
+  // new senders are refused once max_sessions are alive.
+  // pool_size network sessions are preallocated on start() so that joins don't allocate, evicted sessions
+  // beyond it are released.
+  void set_session_policy(int idle_timeout_ms, int max_sessions, int pool_size = 16);
+
+  // receive on the process wide shared port instead of a per token port, packets are routed by stream_id.
+  // must be called before start().
+  void use_shared_port(uint32_t stream_id);
+
+  // receive on several sockets sharing the port so that decoding spreads over the service threads.
+  // with steer_by_sender a sender always lands on the same shard. linux only, must be called before start().
+  void set_receive_shards(int shards, bool steer_by_sender = true);
+
+  // fill burst losses from the deep redundancy of senders instead of concealing them.
+  // needs a build with AUDIO_DRED, must be called before the first start().
+  void set_deep_redundancy(bool enable);
+
 private:
   std::shared_ptr<OAStreamImpl> impl;
 };
 
 class IAStream
 {
+  friend class AudioOfflineRender;
+
 public:
+  // _hw_name "null", "tone:<hz>" or "noise" synthesizes input without a sound card,
+  // "@<rate>" appended captures at a foreign rate, e.g. "tone:440@44100".
   IAStream(unsigned char _token, const std::string &_hw_name = "default_input",
            AudioBandWidth _bandwidth = AudioBandWidth::Full, AudioPeriodSize _period = AudioPeriodSize::INR_10MS,
-           bool _enable_network = false, bool _enable_auto_reset = false);
+           bool _enable_network = false, bool _enable_auto_reset = false,
+           const AudioEncoderProfile &_profile = AudioEncoderProfile());
 
-  IAStream(unsigned char _token, const OAStream &oas, bool _enable_network = false, bool _enable_auto_reset = false);
+  IAStream(unsigned char _token, const OAStream &oas, bool _enable_network = false, bool _enable_auto_reset = false,
+           const AudioEncoderProfile &_profile = AudioEncoderProfile());
 
   ~IAStream();
 
@@ -83,8 +185,21 @@ public:
 
   bool connect(const std::string &ip, unsigned char token);
 
+  // send to the output stream attached as stream_id on the shared port of the remote process.
+  bool connect_shared(const std::string &ip, uint32_t stream_id);
+
+  // tag packets with a 32-bit source id, receivers key their sessions by it instead of the token.
+  void set_source_id(uint32_t id);
+
   void set_callback(AudioInputCallBack _cb, int _ps, void *_user_data);
 
+  // hand captured frames to a dedicated encoder thread instead of encoding in the audio callback.
+  // takes effect on the next start().
+  void set_capture_handoff(bool enable);
+
+  // applied by the encoder before the next packet, only meaningful with network enabled.
+  void set_encoder_profile(const AudioEncoderProfile &profile);
+
 private:
   std::shared_ptr<IAStreamImpl> impl;
 };
@@ -105,4 +220,55 @@ private:
   std::unique_ptr<AudioPlayerImpl> impl;
 };
 
+// forwards the packets of every sender to its subscribers without decoding them.
+// senders connect to it like to an OAStream with the same token.
+class AudioRelay
+{
+public:
+  // with several shards receiving spreads over the service threads, a sender always stays on one shard.
+  AudioRelay(unsigned char _token, int _shards = 1);
+  ~AudioRelay();
+
+  bool start();
+
+  void stop();
+
+  // returns the subscriber id, -1 if ip can't be resolved.
+  int connect(const std::string &ip, unsigned char token);
+
+  // the destination of extended packets is rewritten to stream_id, legacy packets are not sent there.
+  int connect_shared(const std::string &ip, uint32_t stream_id);
+
+  void disconnect(int subscriber);
+
+  // forward only these senders to the subscriber, an empty list forwards everyone.
+  // senders are source ids, or tokens for packets without extension.
+  void set_filter(int subscriber, const std::vector<uint32_t> &senders);
+
+private:
+  std::shared_ptr<AudioRelayImpl> impl;
+};
+
+// steps streams with file or null devices on a virtual clock as fast as the cpu allows, deterministically.
+// network connections between the added streams are delivered in process instead of over sockets.
+class AudioOfflineRender
+{
+public:
+  AudioOfflineRender();
+  ~AudioOfflineRender();
+
+  // the stream must not be started, the render drives it from now on.
+  bool add(const IAStream &ias);
+
+  bool add(const OAStream &oas);
+
+  // renders ms of media time, returns false once every input has reached its end.
+  bool render(int ms);
+
+  int64_t elapsed_ms() const;
+
+private:
+  std::unique_ptr<AudioOfflineRenderImpl> impl;
+};
+
 #endif
\ No newline at end of file
@@ -10,6 +10,55 @@
 
 namespace
 {
+    constexpr size_t SHARED_RECV_BUFFER_SIZE = 6 * 480;
+#ifdef AUDIO_BATCH_IO
+    constexpr int SHARED_RECV_BATCH_SIZE = AUDIO_BATCH_SIZE;
+#else
+    constexpr int SHARED_RECV_BATCH_SIZE = 1;
+#endif
+
+    void configure_thread(const char *name, const AudioExecutorConfig &cfg)
+    {
+#ifdef __linux__
+        pthread_t thread = pthread_self();
+        if (cfg.policy != AudioSchedPolicy::Default)
+        {
+            struct sched_param param;
+            param.sched_priority = cfg.priority;
+            auto err = pthread_setschedparam(thread, cfg.policy == AudioSchedPolicy::Fifo ? SCHED_FIFO : SCHED_RR, &param);
+            if (err)
+            {
+                AUDIO_INFO_PRINT("%s keeps the default policy: %s\n", name, strerror(err));
+            }
+        }
+        if (!cfg.cpus.empty())
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            for (auto cpu : cfg.cpus)
+            {
+                if (cpu >= 0 && cpu < CPU_SETSIZE)
+                {
+                    CPU_SET(cpu, &cpus);
+                }
+            }
+            auto err = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+            if (err)
+            {
+                AUDIO_ERROR_PRINT("%s affinity: %s\n", name, strerror(err));
+            }
+        }
+        pthread_setname_np(thread, name);
+#else
+        (void)name;
+        (void)cfg;
+#endif
+    }
+
+    constexpr double NULL_DEVICE_TWO_PI = 6.283185307179586;
+    constexpr double NULL_DEVICE_TONE_LEVEL = 0.25 * 32767.0;
+    constexpr uint32_t NULL_DEVICE_NOISE_SHIFT = 3;
+
     int get_specified_device(const std::string &card)
     {
         if (card == "default_input")
@@ -82,12 +131,13 @@ AudioService &AudioService::GetService()
     return instance;
 }
 
-AudioService::AudioService() : work_guard(io_ctx.get_executor())
+AudioService::AudioService() : work_guard(io_ctx.get_executor()), bulk_guard(bulk_ctx.get_executor())
 {
 }
 
-void AudioService::start()
+void AudioService::start(const AudioServiceConfig &_config)
 {
+    config = _config;
 #ifdef _WIN64
     timeBeginPeriod(1);
 #endif
@@ -97,19 +147,20 @@ void AudioService::start()
         AUDIO_ERROR_PRINT("%s\n", Pa_GetErrorText(err));
         return;
     }
-    for (std::size_t i = 0; i < 2; ++i)
+    for (int i = 0; i < std::max(config.realtime.threads, 1); ++i)
     {
         io_thds.emplace_back([this]()
                              {
-#ifdef __linux__
-                                pthread_t thread=pthread_self();
-                                struct sched_param param;
-                                param.sched_priority = 10;
-                                pthread_setschedparam(thread, SCHED_RR, &param);
-                                pthread_setname_np(thread, "audio_thrdpool");
-#endif
+                                configure_thread("audio_thrdpool", config.realtime);
                                 io_ctx.run(); });
     }
+    for (int i = 0; i < std::max(config.bulk.threads, 1); ++i)
+    {
+        io_thds.emplace_back([this]()
+                             {
+                                configure_thread("audio_bulkpool", config.bulk);
+                                bulk_ctx.run(); });
+    }
 }
 
 void AudioService::stop()
@@ -118,10 +169,12 @@ void AudioService::stop()
     timeEndPeriod(1);
 #endif
     io_ctx.stop();
+    bulk_ctx.stop();
     for (auto &thread : io_thds)
     {
         thread.join();
     }
+    io_thds.clear();
 
     auto err = Pa_Terminate();
     if (err != paNoError)
@@ -135,6 +188,113 @@ asio::io_context &AudioService::executor()
     return io_ctx;
 }
 
+asio::io_context &AudioService::bulk_executor()
+{
+    return bulk_ctx;
+}
+
+void AudioService::configure_realtime_thread(const char *name)
+{
+    configure_thread(name, config.realtime);
+}
+
+bool AudioService::attach_stream(uint32_t id, const std::shared_ptr<OAStreamImpl> &oas)
+{
+    std::lock_guard<std::mutex> grd(shared_mtx);
+    if (!shared_sock)
+    {
+        try
+        {
+            shared_sock = std::make_unique<asio::ip::udp::socket>(
+                io_ctx, asio::ip::udp::endpoint(asio::ip::udp::v4(), AUDIO_SHARED_PORT));
+        }
+        catch (const std::exception &e)
+        {
+            AUDIO_ERROR_PRINT("%s\n", e.what());
+            return false;
+        }
+        shared_buf.resize(SHARED_RECV_BATCH_SIZE * SHARED_RECV_BUFFER_SIZE);
+        asio::post(io_ctx, [this]()
+                   { do_shared_receive(); });
+    }
+
+    auto &entry = shared_streams[id];
+    if (!entry.expired() && entry.lock() != oas)
+    {
+        AUDIO_ERROR_PRINT("stream id %u is already attached to the shared port\n", id);
+        return false;
+    }
+    entry = oas;
+    return true;
+}
+
+void AudioService::detach_stream(uint32_t id)
+{
+    std::lock_guard<std::mutex> grd(shared_mtx);
+    shared_streams.erase(id);
+}
+
+void AudioService::do_shared_receive()
+{
+#ifdef AUDIO_BATCH_IO
+    shared_sock->async_wait(asio::ip::udp::socket::wait_read,
+                            [this](std::error_code ec)
+                            {
+                                if (!ec)
+                                {
+                                    size_t lens[SHARED_RECV_BATCH_SIZE];
+                                    int count = 0;
+                                    do
+                                    {
+                                        count = batch_receive(shared_sock->native_handle(), shared_buf.data(),
+                                                              SHARED_RECV_BUFFER_SIZE, lens, SHARED_RECV_BATCH_SIZE);
+                                        for (int i = 0; i < count; i++)
+                                        {
+                                            dispatch_shared_packet(shared_buf.data() + i * SHARED_RECV_BUFFER_SIZE,
+                                                                   lens[i]);
+                                        }
+                                    } while (count == SHARED_RECV_BATCH_SIZE);
+                                }
+                                do_shared_receive();
+                            });
+#else
+    shared_sock->async_receive_from(asio::buffer(shared_buf.data(), SHARED_RECV_BUFFER_SIZE), shared_sender,
+                                    [this](std::error_code ec, std::size_t bytes)
+                                    {
+                                        if (!ec)
+                                        {
+                                            dispatch_shared_packet(shared_buf.data(), bytes);
+                                        }
+                                        do_shared_receive();
+                                    });
+#endif
+}
+
+void AudioService::dispatch_shared_packet(const char *data, size_t bytes)
+{
+    // legacy packets carry no destination and are dropped here.
+    if (!PacketHeader::validate(data, bytes) || !PacketHeader::extended(data))
+    {
+        return;
+    }
+
+    std::shared_ptr<OAStreamImpl> oas;
+    {
+        std::lock_guard<std::mutex> grd(shared_mtx);
+        auto iter = shared_streams.find(PacketHeader::destination(data));
+        if (iter == shared_streams.end())
+        {
+            return;
+        }
+        oas = iter->second.lock();
+    }
+
+    if (oas)
+    {
+        oas->handle_packet(data, bytes);
+    }
+}
+
 // Phsy Input Device
 PhsyIADevice::~PhsyIADevice()
 {
@@ -222,6 +382,14 @@ bool PhsyIADevice::stop()
 }
 
 void PhsyIADevice::transfer_pcm_data(int16_t *input, int frame_number)
+{
+    if (!stream->handoff_pcm_frames(input, frame_number))
+    {
+        process_pcm_data(input, frame_number);
+    }
+}
+
+void PhsyIADevice::process_pcm_data(int16_t *input, int frame_number)
 {
     if (stream->sampler)
     {
@@ -283,9 +451,10 @@ bool WaveIADevice::stop()
     return true;
 }
 
-bool WaveIADevice::async_task(int interv)
+bool WaveIADevice::async_task(int frames)
 {
-    auto frame_number = ceil_div(interv * ifs.sample_rate(), 1000);
+    played_frames += frames;
+    auto frame_number = (int)(played_frames * ifs.sample_rate() / iastream->fs - ifs.tell());
     if (ifs.tell() + frame_number >= ifs.frame_number())
     {
         return false;
@@ -317,6 +486,134 @@ bool WaveIADevice::enable_external_loop() const
     return true;
 }
 
+bool WaveIADevice::blocking_task() const
+{
+    return true;
+}
+
+// Null Input Device
+NullIADevice::~NullIADevice()
+{
+    delete[] pick_ups;
+}
+
+bool NullIADevice::match(const std::string &name)
+{
+    return name.compare(0, 4, "null") == 0 || name.compare(0, 4, "tone") == 0 || name.compare(0, 5, "noise") == 0;
+}
+
+bool NullIADevice::create(const std::string &name, void *cls, int &fs, int &ps, int &chan, int &max_chan)
+{
+    if (name.compare(0, 4, "tone") == 0)
+    {
+        signal = Signal::Tone;
+        auto colon = name.find(':');
+        if (colon != std::string::npos && std::atof(name.c_str() + colon + 1) > 0)
+        {
+            tone_hz = std::atof(name.c_str() + colon + 1);
+        }
+    }
+    else if (name.compare(0, 5, "noise") == 0)
+    {
+        signal = Signal::Noise;
+    }
+
+    auto at = name.find('@');
+    device_fs = at != std::string::npos ? std::atoi(name.c_str() + at + 1) : fs;
+    if (device_fs <= 0)
+    {
+        device_fs = fs;
+    }
+
+    iastream = reinterpret_cast<IAStreamImpl *>(cls);
+    max_chan = chan = 1;
+    if (device_fs != fs)
+    {
+        // exercise the same resampling path as a sound card running at its own rate.
+        AUDIO_INFO_PRINT("require fs %d, resample from %d\n", fs, device_fs);
+        iastream->set_resampler_parameter(device_fs, fs, chan);
+    }
+    pick_ups = new int16_t[std::max(ps, ceil_div(ps * device_fs, fs)) * chan];
+    AUDIO_INFO_PRINT("null idevice: %s, token = %u, ichan = %d, max_chan = %d, fs = %d, ps = %d\n", name.c_str(),
+                     iastream->token, chan, max_chan, fs, ps);
+    ready = true;
+    return true;
+}
+
+bool NullIADevice::start()
+{
+    if (!ready)
+    {
+        AUDIO_ERROR_PRINT("device created failed. would not be opened.\n");
+        return false;
+    }
+    return true;
+}
+
+bool NullIADevice::stop()
+{
+    return true;
+}
+
+bool NullIADevice::async_task(int frames)
+{
+    played_frames += frames;
+    auto frame_number = (int)(played_frames * device_fs / iastream->fs - generated_frames);
+    generate(frame_number);
+    generated_frames += frame_number;
+
+    if (iastream->sampler)
+    {
+        int16_t *out = pick_ups;
+        size_t out_frames = 0;
+        iastream->sampler->commit(pick_ups, frame_number, out, out_frames);
+        iastream->read_raw_frames(out, (int)out_frames);
+        iastream->read_pcm_frames(out, (int)out_frames);
+    }
+    else
+    {
+        iastream->read_raw_frames(pick_ups, frame_number);
+        iastream->read_pcm_frames(pick_ups, frame_number);
+    }
+    return true;
+}
+
+bool NullIADevice::enable_external_loop() const
+{
+    return true;
+}
+
+void NullIADevice::generate(int frame_number)
+{
+    switch (signal)
+    {
+    case Signal::Tone:
+    {
+        auto step = NULL_DEVICE_TWO_PI * tone_hz / device_fs;
+        for (int i = 0; i < frame_number; i++)
+        {
+            pick_ups[i] = (int16_t)(NULL_DEVICE_TONE_LEVEL * std::sin(phase));
+            phase += step;
+        }
+        phase = std::fmod(phase, NULL_DEVICE_TWO_PI);
+        break;
+    }
+    case Signal::Noise:
+        for (int i = 0; i < frame_number; i++)
+        {
+            // xorshift32, scaled down to leave headroom for mixing.
+            noise_state ^= noise_state << 13;
+            noise_state ^= noise_state >> 17;
+            noise_state ^= noise_state << 5;
+            pick_ups[i] = (int16_t)((int32_t)noise_state >> (16 + NULL_DEVICE_NOISE_SHIFT));
+        }
+        break;
+    default:
+        std::memset(pick_ups, 0, frame_number * sizeof(int16_t));
+        break;
+    }
+}
+
 // Pipe Input Device
 PipeIADevice::~PipeIADevice()
 {
@@ -361,6 +658,14 @@ bool PipeIADevice::stop()
 }
 
 void PipeIADevice::transfer_pcm_data(int16_t *input, int frame_number)
+{
+    if (!iastream->handoff_pcm_frames(input, frame_number))
+    {
+        process_pcm_data(input, frame_number);
+    }
+}
+
+void PipeIADevice::process_pcm_data(int16_t *input, int frame_number)
 {
     iastream->read_raw_frames(input, frame_number);
     iastream->read_pcm_frames(input, frame_number);
@@ -461,6 +766,14 @@ bool MultiIADevice::stop()
 }
 
 void MultiIADevice::transfer_pcm_data(int16_t *input, int frame_number)
+{
+    if (!stream->handoff_pcm_frames(input, frame_number))
+    {
+        process_pcm_data(input, frame_number);
+    }
+}
+
+void MultiIADevice::process_pcm_data(int16_t *input, int frame_number)
 {
     stream->read_raw_frames(input, frame_number);
     auto dst = pick_ups;
@@ -600,11 +913,10 @@ bool WaveOADevice::stop()
     return true;
 }
 
-bool WaveOADevice::async_task(int interv)
+bool WaveOADevice::async_task(int frames)
 {
-    auto frame_number = ceil_div(interv * oastream->fs, 1000);
-    oastream->write_pcm_frames(pick_ups, frame_number);
-    if (!ofs.write((const char *)pick_ups, (std::streamsize)(sizeof(int16_t) * frame_number)))
+    oastream->write_pcm_frames(pick_ups, frames);
+    if (!ofs.write((const char *)pick_ups, (std::streamsize)(sizeof(int16_t) * frames)))
     {
         return false;
     }
@@ -616,6 +928,64 @@ bool WaveOADevice::enable_external_loop() const
     return true;
 }
 
+bool WaveOADevice::blocking_task() const
+{
+    return true;
+}
+
+// Null Output Device
+NullOADevice::~NullOADevice()
+{
+    delete[] pick_ups;
+}
+
+bool NullOADevice::match(const std::string &name)
+{
+    return name.compare(0, 4, "null") == 0;
+}
+
+bool NullOADevice::create(const std::string &name, void *cls, int &fs, int &ps, int &chan, int &max_chan)
+{
+    oastream = static_cast<OAStreamImpl *>(cls);
+    max_chan = chan = 2;
+    if (fs == 0)
+    {
+        fs = 48000;
+    }
+    ps = ceil_div(ps * fs, 1000);
+    pick_ups = new int16_t[ps * chan];
+    AUDIO_INFO_PRINT("null odevice: %s,token = %u, ochan = %d, max_chan = %d, fs = %d, ps = %d\n", name.c_str(),
+                     oastream->token, chan, max_chan, fs, ps);
+    ready = true;
+    return true;
+}
+
+bool NullOADevice::start()
+{
+    if (!ready)
+    {
+        AUDIO_ERROR_PRINT("device created failed. would not be opened.\n");
+        return false;
+    }
+    return true;
+}
+
+bool NullOADevice::stop()
+{
+    return true;
+}
+
+bool NullOADevice::async_task(int frames)
+{
+    oastream->write_pcm_frames(pick_ups, frames);
+    return true;
+}
+
+bool NullOADevice::enable_external_loop() const
+{
+    return true;
+}
+
 // Phys Multi Output Device
 MultiOADevice::~MultiOADevice()
 {
@@ -24,7 +24,12 @@ public:
   {
   }
 
-  virtual bool async_task(int interval)
+  virtual void process_pcm_data(int16_t *data, int frame_number)
+  {
+  }
+
+  // produce or consume one period of frames at the stream rate, paced by the stream's media clock.
+  virtual bool async_task(int frames)
   {
     return false;
   }
@@ -34,6 +39,12 @@ public:
     return false;
   }
 
+  // devices whose task blocks on disk are paced from the bulk executor.
+  virtual bool blocking_task() const
+  {
+    return false;
+  }
+
 protected:
   bool ready{false};
 };
@@ -53,6 +64,8 @@ public:
 
   void transfer_pcm_data(int16_t *input, int frame_number) override;
 
+  void process_pcm_data(int16_t *input, int frame_number) override;
+
 private:
   PaStream *device;
   IAStreamImpl *stream;
@@ -62,7 +75,7 @@ private:
 class WaveIADevice final : public AudioDevice
 {
 public:
-  WaveIADevice(asio::io_context &_io) : io_ctx(_io), timer(io_ctx), iastream(nullptr), pick_ups(nullptr)
+  WaveIADevice(asio::io_context &_io) : io_ctx(_io), timer(io_ctx), iastream(nullptr), pick_ups(nullptr), played_frames(0)
   {
   }
   ~WaveIADevice() override;
@@ -73,16 +86,20 @@ public:
 
   bool stop() override;
 
-  bool async_task(int interv) override;
+  bool async_task(int frames) override;
 
   bool enable_external_loop() const override;
 
+  bool blocking_task() const override;
+
 private:
   asio::io_context &io_ctx;
   asio::steady_timer timer;
   WavFile ifs;
   IAStreamImpl *iastream;
   int16_t *pick_ups;
+  // frames handed to the stream so far, file positions are derived from it to avoid rounding drift.
+  uint64_t played_frames;
 };
 
 // Phys Multi Input Device
@@ -101,6 +118,8 @@ public:
 
   void transfer_pcm_data(int16_t *input, int frame_number) override;
 
+  void process_pcm_data(int16_t *input, int frame_number) override;
+
 private:
   PaStream *device{nullptr};
   IAStreamImpl *stream{nullptr};
@@ -125,6 +144,8 @@ public:
 
   void transfer_pcm_data(int16_t *input, int frame_number) override;
 
+  void process_pcm_data(int16_t *input, int frame_number) override;
+
 private:
   std::weak_ptr<OAStreamImpl> oas;
   IAStreamImpl *iastream;
@@ -165,10 +186,12 @@ public:
 
   bool stop() override;
 
-  bool async_task(int interv) override;
+  bool async_task(int frames) override;
 
   bool enable_external_loop() const override;
 
+  bool blocking_task() const override;
+
 private:
   asio::io_context &io_ctx;
   asio::steady_timer timer;
@@ -177,6 +200,78 @@ private:
   int16_t *pick_ups;
 };
 
+// Null Output Device, mixes on the media clock and discards the result.
+class NullOADevice final : public AudioDevice
+{
+public:
+  NullOADevice() : oastream(nullptr), pick_ups(nullptr)
+  {
+  }
+  ~NullOADevice() override;
+
+  static bool match(const std::string &name);
+
+  bool create(const std::string &name, void *cls, int &fs, int &ps, int &chan, int &max_chan) override;
+
+  bool start() override;
+
+  bool stop() override;
+
+  bool async_task(int frames) override;
+
+  bool enable_external_loop() const override;
+
+private:
+  OAStreamImpl *oastream;
+  int16_t *pick_ups;
+};
+
+// Null Input Device, synthesizes silence, a tone or white noise on the media clock.
+// names are "null", "tone:<hz>" or "noise", optionally followed by "@<rate>" to capture at a foreign rate.
+class NullIADevice final : public AudioDevice
+{
+public:
+  NullIADevice()
+      : iastream(nullptr), pick_ups(nullptr), signal(Signal::Silence), tone_hz(1000.0), device_fs(0), phase(0),
+        noise_state(0x12345678u), played_frames(0), generated_frames(0)
+  {
+  }
+  ~NullIADevice() override;
+
+  static bool match(const std::string &name);
+
+  bool create(const std::string &name, void *cls, int &fs, int &ps, int &chan, int &max_chan) override;
+
+  bool start() override;
+
+  bool stop() override;
+
+  bool async_task(int frames) override;
+
+  bool enable_external_loop() const override;
+
+private:
+  enum class Signal
+  {
+    Silence,
+    Tone,
+    Noise
+  };
+
+  void generate(int frame_number);
+
+private:
+  IAStreamImpl *iastream;
+  int16_t *pick_ups;
+  Signal signal;
+  double tone_hz;
+  int device_fs;
+  double phase;
+  uint32_t noise_state;
+  uint64_t played_frames;
+  uint64_t generated_frames;
+};
+
 // Phys Multi Output Device
 class MultiOADevice final : public AudioDevice
 {
@@ -1,193 +1,1298 @@
 #include "audio_network.h"
+#include "audio_process.h"
+#include <algorithm>
+#include <array>
 #include <cmath>
 
+#ifdef AUDIO_BATCH_IO
+#include <sys/socket.h>
+#endif
+
+#ifdef AUDIO_REUSEPORT
+#include <linux/filter.h>
+#include <sys/socket.h>
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <dispatch/dispatch.h>
+#else
+#include <cerrno>
+#include <semaphore.h>
+#endif
+
 namespace
 {
-    constexpr char AUDIO_PACKET_MONO_CHAN = 1;
-    constexpr char AUDIO_PACKET_DUAL_CHAN = 2;
-    constexpr char MINIMUM_AUDIO_ENCODER_IDX = enum2val(AudioEncoderFormat::PCM);
-    constexpr char MAXIMUM_AUDIO_ENCODER_IDX = enum2val(AudioEncoderFormat::OPUS);
-    constexpr uint64_t fixedFraction = 1LL << 32;
-    constexpr double normFixed = 1.0 / (1LL << 32);
+    constexpr char AUDIO_PACKET_MONO_CHAN = 1;
+    constexpr char AUDIO_PACKET_DUAL_CHAN = 2;
+    constexpr char MINIMUM_AUDIO_ENCODER_IDX = enum2val(AudioEncoderFormat::PCM);
+    constexpr char MAXIMUM_AUDIO_ENCODER_IDX = enum2val(AudioEncoderFormat::OPUS);
+    constexpr uint8_t AUDIO_PACKET_EXTENDED = 0x80;
+    constexpr uint8_t AUDIO_COMPACT_VERSION_MASK = 0xc0;
+    constexpr uint8_t AUDIO_COMPACT_VERSION = 0x40;
+    constexpr uint8_t AUDIO_COMPACT_EXTENDED = 0x20;
+    constexpr uint8_t AUDIO_COMPACT_RATE_MASK = 0x18;
+    constexpr int AUDIO_COMPACT_RATE_SHIFT = 3;
+    constexpr uint8_t AUDIO_COMPACT_FEC = 0x04;
+    constexpr uint8_t AUDIO_COMPACT_RESUMED = 0x02;
+    // sample rates of the compact header in khz, indexed by the rate bits.
+    constexpr uint8_t AUDIO_COMPACT_RATES[] = {8, 16, 24, 48};
+    // the target is capped at a third of the capacity and has to cover the longest packet plus the longest period.
+    constexpr int JITTER_BUFFER_CAPACITY_MS = 3 * (AUDIO_PACKET_MAX_MS + enum2val(AudioPeriodSize::INR_40MS));
+    constexpr double JITTER_BUFFER_DEPTH_FACTOR = 4.0;
+    constexpr uint64_t JITTER_BUFFER_SEQ_OFFSET = 1ULL << 32;
+    constexpr size_t JITTER_RECORD_HEAD = 4;
+    constexpr size_t JITTER_SLOT_COUNT = 64;
+    constexpr double DRIFT_MAX_DEVIATION = 0.001;
+    constexpr double DRIFT_LEVEL_TIME_CONSTANT = 1.0;
+    constexpr double DRIFT_KP = 0.05;
+    constexpr double DRIFT_KI = DRIFT_KP / 40.0;
+    constexpr int OPUS_DTX_PACKET_BYTES = 2;
+    constexpr int SILENCE_HANGOVER_MS = 200;
+    constexpr int DECODER_CONCEAL_MAX_MS = 120;
+    // further back than any jitter buffer reaches, such a step back is a sender that started over.
+    constexpr int32_t DECODER_RESTART_PACKETS = 128;
+    constexpr int DRED_MAX_DURATION_MS = 1000;
+    constexpr int DRED_MIN_LOSS_PERC = 5;
+    constexpr float SPEAKER_LEVEL_RELEASE = 0.9f;
+
+    inline float track_level(float level, const char *data, size_t len, int periods = 1)
+    {
+        // fast attack, slow release, so that short pauses between words keep the speaker.
+        // a packet standing for several periods releases as if each of them had been heard.
+        auto ms = (float)mean_square((const int16_t *)data, len / sizeof(int16_t));
+        if (ms > level)
+        {
+            return ms;
+        }
+        auto release = std::pow(SPEAKER_LEVEL_RELEASE, (float)periods);
+        return level * release + ms * (1.0f - release);
+    }
+
+    thread_local const std::chrono::steady_clock::time_point *virtual_clock = nullptr;
+
+    inline size_t next_power_of_two(size_t v)
+    {
+        size_t result = 1;
+        while (result < v)
+        {
+            result <<= 1;
+        }
+        return result;
+    }
+} // namespace
+
+std::chrono::steady_clock::time_point media_now()
+{
+    return virtual_clock ? *virtual_clock : std::chrono::steady_clock::now();
+}
+
+void bind_virtual_clock(const std::chrono::steady_clock::time_point *now)
+{
+    virtual_clock = now;
+}
+
+bool PacketHeader::validate(const char *data, size_t len)
+{
+    if (len < sizeof(CompactHeader))
+    {
+        return false;
+    }
+
+    if (compact(data))
+    {
+        // channels come from the toc byte, so at least one payload byte must follow.
+        return len > length(data);
+    }
+
+    if (len < sizeof(PacketHeader))
+    {
+        return false;
+    }
+
+    if (data[1] != AUDIO_PACKET_MONO_CHAN && data[1] != AUDIO_PACKET_DUAL_CHAN)
+    {
+        return false;
+    }
+
+    if (cast_uint8_as_bandwidth((uint8_t)data[2]) == AudioBandWidth::Unknown)
+    {
+        return false;
+    }
+
+    auto enc_fmt = (char)((uint8_t)data[3] & ~AUDIO_PACKET_EXTENDED);
+    if (enc_fmt < MINIMUM_AUDIO_ENCODER_IDX || enc_fmt > MAXIMUM_AUDIO_ENCODER_IDX)
+    {
+        return false;
+    }
+
+    return len >= length(data);
+}
+
+bool PacketHeader::compact(const char *data)
+{
+    return ((uint8_t)data[1] & AUDIO_COMPACT_VERSION_MASK) == AUDIO_COMPACT_VERSION;
+}
+
+bool PacketHeader::extended(const char *data)
+{
+    if (compact(data))
+    {
+        return ((uint8_t)data[1] & AUDIO_COMPACT_EXTENDED) != 0;
+    }
+    return ((uint8_t)data[3] & AUDIO_PACKET_EXTENDED) != 0;
+}
+
+size_t PacketHeader::length(const char *data)
+{
+    auto base = compact(data) ? sizeof(CompactHeader) : sizeof(PacketHeader);
+    return extended(data) ? base + sizeof(PacketExtension) : base;
+}
+
+uint8_t PacketHeader::channels(const char *data)
+{
+    if (!compact(data))
+    {
+        return (uint8_t)data[1];
+    }
+    auto count = opus_packet_get_nb_channels((const unsigned char *)data + length(data));
+    return count > 0 ? (uint8_t)count : AUDIO_PACKET_MONO_CHAN;
+}
+
+uint32_t PacketHeader::get_sequence(const char *data, uint32_t reference)
+{
+    if (!compact(data))
+    {
+        uint32_t seq = 0;
+        std::memcpy(&seq, data + offsetof(PacketHeader, sequence), sizeof(seq));
+        return seq;
+    }
+    // the low 16 bits are extended to the full sequence closest to the reference.
+    CompactHeader head{};
+    std::memcpy(&head, data, sizeof(head));
+    return reference + (uint32_t)(int32_t)(int16_t)(uint16_t)(head.sequence - (uint16_t)reference);
+}
+
+uint64_t PacketHeader::get_timestamp(const char *data, uint64_t reference)
+{
+    if (!compact(data))
+    {
+        uint64_t ts = 0;
+        std::memcpy(&ts, data + offsetof(PacketHeader, timestamp), sizeof(ts));
+        return ts;
+    }
+    CompactHeader head{};
+    std::memcpy(&head, data, sizeof(head));
+    auto rate = AUDIO_COMPACT_RATES[(head.control & AUDIO_COMPACT_RATE_MASK) >> AUDIO_COMPACT_RATE_SHIFT];
+    if (reference == 0)
+    {
+        return (uint64_t)head.timestamp * 1000 / rate;
+    }
+    auto base = reference * rate / 1000;
+    auto clock = base + (uint64_t)(int64_t)(int32_t)(head.timestamp - (uint32_t)base);
+    return clock * 1000 / rate;
+}
+
+bool PacketHeader::resumed(const char *data)
+{
+    return compact(data) && ((uint8_t)data[1] & AUDIO_COMPACT_RESUMED) != 0;
+}
+
+bool PacketHeader::fec(const char *data)
+{
+    return !compact(data) || ((uint8_t)data[1] & AUDIO_COMPACT_FEC) != 0;
+}
+
+uint32_t PacketHeader::source(const char *data)
+{
+    if (!extended(data))
+    {
+        return (uint8_t)data[0];
+    }
+    PacketExtension ext{};
+    std::memcpy(&ext, data + length(data) - sizeof(PacketExtension), sizeof(ext));
+    return ext.source;
+}
+
+uint32_t PacketHeader::destination(const char *data)
+{
+    if (!extended(data))
+    {
+        return 0;
+    }
+    PacketExtension ext{};
+    std::memcpy(&ext, data + length(data) - sizeof(PacketExtension), sizeof(ext));
+    return ext.destination;
+}
+
+void PacketHeader::set_destination(char *data, uint32_t id)
+{
+    if (extended(data))
+    {
+        std::memcpy(data + length(data) - sizeof(uint32_t), &id, sizeof(id));
+    }
+}
+
+SpscRing::SpscRing(size_t min_capacity)
+    : head_idx(0), tail_cache(0), tail_idx(0), head_cache(0), capacity(next_power_of_two(min_capacity)),
+      mask(capacity - 1)
+{
+    ring = new int16_t[capacity];
+}
+
+SpscRing::~SpscRing()
+{
+    delete[] ring;
+}
+
+bool SpscRing::push(const int16_t *head, size_t head_len, const int16_t *data, size_t len)
+{
+    auto wr = head_idx.load(std::memory_order_relaxed);
+    if (capacity - (wr - tail_cache) < head_len + len)
+    {
+        tail_cache = tail_idx.load(std::memory_order_acquire);
+        if (capacity - (wr - tail_cache) < head_len + len)
+        {
+            return false;
+        }
+    }
+
+    for (auto span : {std::make_pair(head, head_len), std::make_pair(data, len)})
+    {
+        if (span.second == 0)
+        {
+            continue;
+        }
+        auto offset = wr & mask;
+        auto count = std::min(span.second, capacity - offset);
+        std::memcpy(ring + offset, span.first, count * sizeof(int16_t));
+        std::memcpy(ring, span.first + count, (span.second - count) * sizeof(int16_t));
+        wr += span.second;
+    }
+    head_idx.store(wr, std::memory_order_release);
+    return true;
+}
+
+bool SpscRing::pop(int16_t *data, size_t len)
+{
+    auto rd = tail_idx.load(std::memory_order_relaxed);
+    if (head_cache - rd < len)
+    {
+        head_cache = head_idx.load(std::memory_order_acquire);
+        if (head_cache - rd < len)
+        {
+            return false;
+        }
+    }
+
+    auto offset = rd & mask;
+    auto count = std::min(len, capacity - offset);
+    std::memcpy(data, ring + offset, count * sizeof(int16_t));
+    std::memcpy(data + count, ring, (len - count) * sizeof(int16_t));
+    tail_idx.store(rd + len, std::memory_order_release);
+    return true;
+}
+
+size_t SpscRing::skip(size_t len)
+{
+    auto rd = tail_idx.load(std::memory_order_relaxed);
+    head_cache = head_idx.load(std::memory_order_acquire);
+    len = std::min(len, head_cache - rd);
+    tail_idx.store(rd + len, std::memory_order_release);
+    return len;
+}
+
+size_t SpscRing::size() const
+{
+    return head_idx.load(std::memory_order_acquire) - tail_idx.load(std::memory_order_acquire);
+}
+
+void SpscRing::reset()
+{
+    // neither side may be active while the ring is reset.
+    head_idx.store(0);
+    tail_idx.store(0);
+    head_cache = 0;
+    tail_cache = 0;
+}
+
+WakeSignal::WakeSignal()
+{
+    // unnamed posix semaphores are not available on macos, dispatch semaphores are used there instead.
+#if defined(_WIN32)
+    handle = CreateSemaphore(nullptr, 0, LONG_MAX, nullptr);
+#elif defined(__APPLE__)
+    handle = dispatch_semaphore_create(0);
+#else
+    auto sem = new sem_t;
+    sem_init(sem, 0, 0);
+    handle = sem;
+#endif
+}
+
+WakeSignal::~WakeSignal()
+{
+#if defined(_WIN32)
+    CloseHandle((HANDLE)handle);
+#elif defined(__APPLE__)
+    dispatch_release((dispatch_semaphore_t)handle);
+#else
+    sem_destroy((sem_t *)handle);
+    delete (sem_t *)handle;
+#endif
+}
+
+void WakeSignal::post()
+{
+#if defined(_WIN32)
+    ReleaseSemaphore((HANDLE)handle, 1, nullptr);
+#elif defined(__APPLE__)
+    dispatch_semaphore_signal((dispatch_semaphore_t)handle);
+#else
+    sem_post((sem_t *)handle);
+#endif
+}
+
+void WakeSignal::wait()
+{
+#if defined(_WIN32)
+    WaitForSingleObject((HANDLE)handle, INFINITE);
+#elif defined(__APPLE__)
+    dispatch_semaphore_wait((dispatch_semaphore_t)handle, DISPATCH_TIME_FOREVER);
+#else
+    while (sem_wait((sem_t *)handle) != 0 && errno == EINTR)
+    {
+    }
+#endif
+}
+
+DriftController::DriftController(int _fs, int ps)
+    : fs(_fs), dt((double)ps / _fs), alpha(std::min(1.0, dt / DRIFT_LEVEL_TIME_CONSTANT)), primed(false), level(0),
+      integral(0)
+{
+}
+
+double DriftController::update(size_t fill, size_t target)
+{
+    // PI loop on the smoothed fill level, the output is the input/output frame ratio.
+    if (!primed)
+    {
+        level = (double)fill;
+        primed = true;
+    }
+    level += alpha * ((double)fill - level);
+
+    auto err = (level - (double)target) / fs;
+    auto limit = DRIFT_MAX_DEVIATION / DRIFT_KI;
+    integral = std::min(std::max(integral + err * dt, -limit), limit);
+    auto adjust = DRIFT_KP * err + DRIFT_KI * integral;
+    return 1.0 + std::min(std::max(adjust, -DRIFT_MAX_DEVIATION), DRIFT_MAX_DEVIATION);
+}
+
+void DriftController::resync()
+{
+    // the integral carries the clock offset estimate and survives underruns.
+    primed = false;
+}
+
+void DriftController::reset()
+{
+    primed = false;
+    level = 0;
+    integral = 0;
+}
+
+SessionData::SessionData(size_t blk_sz, size_t blk_num, int _chan, int _fs)
+    : chan(_chan), max_len(2 * blk_sz * blk_num), enable(true), selected(true), level(0),
+      buf(max_len / sizeof(int16_t) + blk_sz), pull_buf(nullptr)
+{
+    out_buf = new char[blk_sz];
+    if (_fs > 0)
+    {
+        auto frames = blk_sz / (chan * sizeof(int16_t));
+        drift = std::make_unique<DriftController>(_fs, (int)frames);
+        varispeed = std::make_unique<VarispeedResampler>(chan, frames);
+        pull_buf = new int16_t[2 * frames * chan];
+    }
+}
+
+SessionData::~SessionData()
+{
+    delete[] out_buf;
+    delete[] pull_buf;
+}
+
+void SessionData::store_data(const char *data, size_t len)
+{
+    level.store(track_level(level.load(std::memory_order_relaxed), data, len), std::memory_order_relaxed);
+    buf.push(nullptr, 0, (const int16_t *)data, len / sizeof(int16_t));
+}
+
+void SessionData::load_data(size_t len)
+{
+    if (varispeed)
+    {
+        // hold the fill level at half of the overflow threshold.
+        auto frames = len / (chan * sizeof(int16_t));
+        auto ratio = drift->update(buf.size() / chan, max_len / (2 * chan * sizeof(int16_t)));
+        auto need = varispeed->required(frames, ratio);
+        if (buf.pop(pull_buf, need * chan))
+        {
+            varispeed->process(pull_buf, need, (int16_t *)out_buf, frames, ratio);
+        }
+        else
+        {
+            std::memset(out_buf, 0, len);
+            drift->resync();
+        }
+    }
+    else if (!buf.pop((int16_t *)out_buf, len / sizeof(int16_t)))
+    {
+        std::memset(out_buf, 0, len);
+    }
+    if (buf.size() * sizeof(int16_t) > max_len)
+    {
+        buf.skip(max_len / sizeof(int16_t));
+    }
+}
+
+void SessionData::skip_data()
+{
+    buf.skip(buf.size());
+    if (drift)
+    {
+        drift->resync();
+    }
+}
+
+void SessionData::reset()
+{
+    buf.reset();
+    enable = true;
+    selected = true;
+    level = 0;
+    if (drift)
+    {
+        drift->reset();
+        varispeed->reset(chan);
+    }
+}
+
+JitterBuffer::JitterBuffer(int _fs, int _ps, int _chan)
+    : max_chan(_chan), chan(_chan), enable(true), selected(true), level(0), fs(_fs), ps(_ps),
+      capacity(_fs * JITTER_BUFFER_CAPACITY_MS / 1000), inbound(capacity * _chan + JITTER_RECORD_HEAD * 64),
+      jitter_frames(0), play_seq(0), play_depth(0), drift(_fs, _ps), primed(false), buffering(true), seq_last(0), seq_ext(0), read_pos(0),
+      write_end(0), last_end(0), pkt_frames(0), target(0)
+{
+    ring = new int16_t[capacity * max_chan];
+    std::memset(ring, 0, capacity * max_chan * sizeof(int16_t));
+    slot_ext = new uint64_t[JITTER_SLOT_COUNT]();
+    slot_pos = new uint64_t[JITTER_SLOT_COUNT]();
+    pkt_buf = new int16_t[capacity / 2 * max_chan];
+    pull_buf = new int16_t[2 * ps * max_chan];
+    out_buf = new char[ps * max_chan * sizeof(int16_t)];
+    varispeed = std::make_unique<VarispeedResampler>(max_chan, ps);
+}
+
+JitterBuffer::~JitterBuffer()
+{
+    delete[] ring;
+    delete[] slot_ext;
+    delete[] slot_pos;
+    delete[] pkt_buf;
+    delete[] pull_buf;
+    delete[] out_buf;
+}
+
+void JitterBuffer::store_data(uint32_t seq, const char *data, size_t len, int level_periods)
+{
+    auto frames = len / (chan * sizeof(int16_t));
+    if (frames == 0 || frames > capacity / 2)
+    {
+        return;
+    }
+
+    if (level_periods > 0)
+    {
+        level.store(track_level(level.load(std::memory_order_relaxed), data, frames * chan * sizeof(int16_t),
+                                level_periods),
+                    std::memory_order_relaxed);
+    }
+    int16_t head[JITTER_RECORD_HEAD] = {(int16_t)(seq & 0xffff), (int16_t)(seq >> 16), (int16_t)frames, 0};
+    inbound.push(head, JITTER_RECORD_HEAD, (const int16_t *)data, frames * chan);
+}
+
+void JitterBuffer::load_data(size_t len)
+{
+    std::memset(out_buf, 0, len);
+    auto frames = len / (chan * sizeof(int16_t));
+
+    int16_t head[JITTER_RECORD_HEAD];
+    while (inbound.pop(head, JITTER_RECORD_HEAD))
+    {
+        auto seq = (uint32_t)(uint16_t)head[0] | (uint32_t)(uint16_t)head[1] << 16;
+        auto pkt_len = (size_t)(uint16_t)head[2];
+        inbound.pop(pkt_buf, pkt_len * chan);
+        place_packet(seq, pkt_buf, pkt_len);
+    }
+
+    if (!primed)
+    {
+        return;
+    }
+
+    update_target();
+    publish_window();
+    auto fill = write_end > read_pos ? write_end - read_pos : 0;
+    if (fill > 2 * target)
+    {
+        // keep the newest audio, only the oldest frames above target are discarded.
+        drop_frames(write_end - target);
+        fill = target;
+    }
+
+    if (buffering && fill >= target)
+    {
+        buffering = false;
+    }
+
+    // the sender clock is tracked by consuming slightly more or less than one period,
+    // half a packet of headroom keeps the arrival sawtooth above the playout threshold.
+    auto ratio = drift.update(fill, target + pkt_frames / 2);
+    auto need = varispeed->required(frames, ratio);
+    if (buffering || fill < need)
+    {
+        buffering = true;
+        drift.resync();
+        return;
+    }
+
+    auto offset = (size_t)(read_pos % capacity);
+    auto count = std::min(need, capacity - offset);
+    std::memcpy(pull_buf, ring + offset * chan, count * chan * sizeof(int16_t));
+    std::memcpy(pull_buf + count * chan, ring, (need - count) * chan * sizeof(int16_t));
+    drop_frames(read_pos + need);
+    varispeed->process(pull_buf, need, (int16_t *)out_buf, frames, ratio);
+}
+
+void JitterBuffer::skip_data()
+{
+    // discard pending packets unplayed, playout re-primes from scratch once the session is heard again.
+    int16_t head[JITTER_RECORD_HEAD];
+    while (inbound.pop(head, JITTER_RECORD_HEAD))
+    {
+        inbound.skip((size_t)(uint16_t)head[2] * chan);
+    }
+
+    if (primed)
+    {
+        primed = false;
+        play_depth.store(0, std::memory_order_relaxed);
+        drift.resync();
+    }
+}
+
+void JitterBuffer::update_jitter(double jitter_us)
+{
+    jitter_frames.store((size_t)(JITTER_BUFFER_DEPTH_FACTOR * jitter_us * fs / 1e6), std::memory_order_relaxed);
+}
+
+uint32_t JitterBuffer::playable_since(uint32_t seq) const
+{
+    auto oldest = seq - play_depth.load(std::memory_order_relaxed);
+    auto next = play_seq.load(std::memory_order_relaxed);
+    if ((int32_t)(next - oldest) > 0)
+    {
+        oldest = (int32_t)(seq - next) > 0 ? next : seq;
+    }
+    return oldest;
+}
+
+void JitterBuffer::reset(int _chan)
+{
+    // only called on an unreachable buffer, e.g. when a pooled slot is handed to a new sender.
+    chan = std::min(_chan, max_chan);
+    inbound.reset();
+    jitter_frames = 0;
+    play_seq = 0;
+    play_depth = 0;
+    enable = true;
+    selected = true;
+    level = 0;
+    drift.reset();
+    varispeed->reset(chan);
+    std::memset(ring, 0, capacity * max_chan * sizeof(int16_t));
+    primed = false;
+    buffering = true;
+    seq_last = 0;
+    seq_ext = 0;
+    read_pos = 0;
+    write_end = 0;
+    last_end = 0;
+    std::fill(slot_ext, slot_ext + JITTER_SLOT_COUNT, 0);
+    pkt_frames = 0;
+    target = 0;
+}
+
+void JitterBuffer::place_packet(uint32_t seq, const int16_t *data, size_t frames)
+{
+    // extend the 32-bit sequence so that it keeps growing across wraparound.
+    auto ext = primed ? seq_ext + (int64_t)(int32_t)(seq - seq_last) : JITTER_BUFFER_SEQ_OFFSET + seq;
+    // positions follow the frames actually received, resampled packets come one frame above or
+    // below the nominal size (e.g. 220 and 221 frames for 5 ms at 44.1 khz).
+    auto discontinuity = !primed || frames + 1 < pkt_frames || frames > pkt_frames + 1;
+    uint64_t pos = 0;
+    if (!discontinuity)
+    {
+        if (ext > seq_ext)
+        {
+            pos = last_end + (ext - seq_ext - 1) * pkt_frames;
+            discontinuity = pos > write_end + capacity;
+        }
+        else if (slot_ext[ext % JITTER_SLOT_COUNT] == ext)
+        {
+            pos = slot_pos[ext % JITTER_SLOT_COUNT];
+        }
+        else
+        {
+            // older than the slots, counted back from the newest packet in nominal packet sizes.
+            pos = last_end - (seq_ext - ext + 1) * pkt_frames;
+            discontinuity = pos + capacity < read_pos;
+        }
+    }
+
+    if (discontinuity)
+    {
+        // first packet, frame size change or a discontinuity larger than the whole buffer.
+        pkt_frames = frames;
+        update_target();
+        std::memset(ring, 0, capacity * chan * sizeof(int16_t));
+        std::fill(slot_ext, slot_ext + JITTER_SLOT_COUNT, 0);
+        pos = ext * frames;
+        read_pos = pos - target;
+        write_end = pos;
+        last_end = pos;
+        seq_ext = ext;
+        seq_last = seq;
+        primed = true;
+        buffering = true;
+    }
+
+    if (ext >= seq_ext)
+    {
+        // missing sequences get nominal-sized slots so that they still land in place when they come late.
+        for (auto n = std::max(seq_ext + 1, ext - JITTER_SLOT_COUNT + 1); n < ext; n++)
+        {
+            slot_ext[n % JITTER_SLOT_COUNT] = n;
+            slot_pos[n % JITTER_SLOT_COUNT] = last_end + (n - seq_ext - 1) * pkt_frames;
+        }
+        slot_ext[ext % JITTER_SLOT_COUNT] = ext;
+        slot_pos[ext % JITTER_SLOT_COUNT] = pos;
+        last_end = pos + frames;
+        seq_ext = ext;
+        seq_last = seq;
+    }
+
+    if (pos + frames <= read_pos)
+    {
+        // too late, its playout time has passed.
+        return;
+    }
+
+    if (pos + frames > read_pos + capacity)
+    {
+        drop_frames(pos + frames - capacity);
+    }
+
+    auto offset = (size_t)(pos % capacity);
+    auto count = std::min(frames, capacity - offset);
+    std::memcpy(ring + offset * chan, data, count * chan * sizeof(int16_t));
+    std::memcpy(ring, data + count * chan, (frames - count) * chan * sizeof(int16_t));
+    write_end = std::max(write_end, pos + frames);
+}
+
+void JitterBuffer::drop_frames(uint64_t pos)
+{
+    // played or dropped frames are cleared so that gaps on the next lap read as silence.
+    if (pos <= read_pos)
+    {
+        return;
+    }
+
+    if (pos - read_pos >= capacity)
+    {
+        std::memset(ring, 0, capacity * chan * sizeof(int16_t));
+    }
+    else
+    {
+        auto frames = (size_t)(pos - read_pos);
+        auto offset = (size_t)(read_pos % capacity);
+        auto count = std::min(frames, capacity - offset);
+        std::memset(ring + offset * chan, 0, count * chan * sizeof(int16_t));
+        std::memset(ring, 0, (frames - count) * chan * sizeof(int16_t));
+    }
+    read_pos = pos;
+}
+
+void JitterBuffer::update_target()
+{
+    // never below one packet and one period, playout would underrun on every packet otherwise.
+    auto jitter = jitter_frames.load(std::memory_order_relaxed);
+    target = std::max(std::min(pkt_frames + ps + jitter, capacity / 3), pkt_frames + ps);
+}
+
+void JitterBuffer::publish_window()
+{
+    // the sequence at the read position is counted back from the newest packet in nominal packet sizes.
+    // anything beyond twice the target is dropped on the next period, and half the ring keeps
+    // the inbound queue from overflowing before the arriving packet is stored.
+    auto behind = last_end > read_pos ? (last_end - read_pos + pkt_frames - 1) / pkt_frames : 0;
+    play_seq.store(seq_last + 1 - (uint32_t)behind, std::memory_order_relaxed);
+    play_depth.store((uint32_t)(std::min(2 * target, capacity / 2) / pkt_frames), std::memory_order_relaxed);
+}
+
+NetEncoder::NetEncoder(uint8_t _sender, uint8_t _channel, int _period, AudioBandWidth _bandwidth,
+                       const AudioEncoderProfile &_profile)
+    : period(_period), fs(enum2val(_bandwidth)), head{_sender, _channel, cast_bandwidth_as_uint8(_bandwidth), 1, 0},
+      source_id(_sender), extended(false), os(&buf), encoder(nullptr), enc_buf(nullptr), packet_frames(_period),
+      pcm_fill(0), pcm_buf(nullptr), ready_head(0), ready_num(0), sample_clock(0), resumed(false),
+      profile_dirty(false), pending(_profile),
+      profile(_profile), gate_level(0), silent_frames(0)
+{
+    buf.prepare(256);
+    enc_buf = new unsigned char[AUDIO_PACKET_MAX_BYTES];
+    pcm_buf = new int16_t[fs / 1000 * AUDIO_PACKET_MAX_MS * head.channel];
+    // the state is allocated once so that the application mode can be switched by re-initialization in place.
+    encoder = (OpusEncoder *)new char[opus_encoder_get_size(head.channel)];
+    if (!apply_profile(true))
+    {
+        delete[](char *) encoder;
+        encoder = nullptr;
+    }
+}
+
+NetEncoder::~NetEncoder()
+{
+    delete[](char *) encoder;
+    delete[] enc_buf;
+    delete[] pcm_buf;
+}
+
+void NetEncoder::set_profile(const AudioEncoderProfile &_profile)
+{
+    std::lock_guard<std::mutex> grd(profile_mtx);
+    pending = _profile;
+    profile_dirty = true;
+}
+
+void NetEncoder::set_source(uint32_t id)
+{
+    source_id = id;
+    extended = true;
+}
+
+void NetEncoder::enable_extension()
+{
+    extended = true;
+}
 
-    uint64_t ReSampleS16LE(const int16_t *input, int16_t *output, int fsi, int fso, uint64_t input_ps, uint32_t channels)
+bool NetEncoder::apply_profile(bool init)
+{
+    AudioEncoderProfile next;
     {
-        uint64_t output_ps = input_ps * fso / fsi;
-        double stepDist = ((double)fsi / (double)fso);
-        uint64_t step = ((uint64_t)(stepDist * fixedFraction + 0.5));
-        uint64_t curOffset = 0;
-        for (size_t i = 0; i < output_ps; i += 1)
-        {
-            for (size_t c = 0; c < channels; c += 1)
-            {
-                *output++ =
-                    (int16_t)(input[c] + (input[c + channels] - input[c]) *
-                                             ((double)(curOffset >> 32) + ((curOffset & (fixedFraction - 1)) * normFixed)));
-            }
-            curOffset += step;
-            input += (curOffset >> 32) * channels;
-            curOffset &= (fixedFraction - 1);
-        }
-        return output_ps;
+        std::lock_guard<std::mutex> grd(profile_mtx);
+        next = pending;
     }
-} // namespace
 
-bool PacketHeader::validate(const char *data, size_t len)
+    if (configure(next, init || next.application != profile.application))
+    {
+        profile = next;
+        return true;
+    }
+
+    // roll back so the encoder keeps matching the stored profile, a state that can't be restored is dropped.
+    if (!init && !configure(profile, true))
+    {
+        delete[](char *) encoder;
+        encoder = nullptr;
+    }
+    return false;
+}
+
+bool NetEncoder::configure(const AudioEncoderProfile &target, bool reinit)
 {
-    if (len < sizeof(PacketHeader))
+    static const int applications[] = {OPUS_APPLICATION_VOIP, OPUS_APPLICATION_AUDIO,
+                                       OPUS_APPLICATION_RESTRICTED_LOWDELAY};
+    static const int signals[] = {OPUS_AUTO, OPUS_SIGNAL_VOICE, OPUS_SIGNAL_MUSIC};
+
+    auto application = enum2val(target.application);
+    auto signal = enum2val(target.signal);
+    if (application < 0 || application >= std::end(applications) - std::begin(applications) || signal < 0 ||
+        signal >= std::end(signals) - std::begin(signals))
     {
+        AUDIO_ERROR_PRINT("unsupported encoder application %d or signal %d\n", application, signal);
         return false;
     }
 
-    if (data[1] != AUDIO_PACKET_MONO_CHAN && data[1] != AUDIO_PACKET_DUAL_CHAN)
+    auto err = 0;
+    if (reinit)
     {
-        return false;
+        // the application can't be changed on a running encoder, restart it with the new mode.
+        err = opus_encoder_init(encoder, fs, head.channel, applications[application]);
+        if (err != OPUS_OK)
+        {
+            AUDIO_ERROR_PRINT("%s\n", opus_strerror(err));
+            return false;
+        }
     }
 
-    if (cast_uint8_as_bandwidth((uint8_t)data[2]) == AudioBandWidth::Unknown)
+    auto bitrate = target.bitrate > 0 ? target.bitrate : OPUS_AUTO;
+    auto complexity = std::min(std::max(target.complexity, 0), 10);
+    auto loss_perc = std::min(std::max(target.packet_loss_perc, 0), 100);
+#ifdef AUDIO_ENABLE_DRED
+    if (target.dred_duration > 0 && loss_perc < DRED_MIN_LOSS_PERC)
+    {
+        // libopus spends no bits on deep redundancy while it expects no loss.
+        AUDIO_INFO_PRINT("deep redundancy raises the expected packet loss to %d%%\n", DRED_MIN_LOSS_PERC);
+        loss_perc = DRED_MIN_LOSS_PERC;
+    }
+#endif
+    if ((err = opus_encoder_ctl(encoder, OPUS_SET_BITRATE(bitrate))) != OPUS_OK ||
+        (err = opus_encoder_ctl(encoder, OPUS_SET_VBR(target.vbr ? 1 : 0))) != OPUS_OK ||
+        (err = opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(complexity))) != OPUS_OK ||
+        (err = opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(target.inband_fec ? 1 : 0))) != OPUS_OK ||
+        (err = opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(loss_perc))) != OPUS_OK ||
+        (err = opus_encoder_ctl(encoder, OPUS_SET_DTX(target.dtx ? 1 : 0))) != OPUS_OK ||
+        (err = opus_encoder_ctl(encoder, OPUS_SET_SIGNAL(signals[signal]))) != OPUS_OK)
     {
+        AUDIO_ERROR_PRINT("%s\n", opus_strerror(err));
         return false;
     }
 
-    if (data[3] < MINIMUM_AUDIO_ENCODER_IDX || data[3] > MAXIMUM_AUDIO_ENCODER_IDX)
+#ifdef AUDIO_ENABLE_DRED
+    // the duration is set in units of 10 ms.
+    auto dred_duration = std::min(std::max(target.dred_duration, 0), DRED_MAX_DURATION_MS) / 10;
+    if ((err = opus_encoder_ctl(encoder, OPUS_SET_DRED_DURATION(dred_duration))) != OPUS_OK)
     {
+        AUDIO_ERROR_PRINT("%s\n", opus_strerror(err));
         return false;
     }
+#else
+    if (target.dred_duration > 0)
+    {
+        AUDIO_ERROR_PRINT("deep redundancy needs a build with AUDIO_DRED, ignored\n");
+    }
+#endif
 
-    return true;
-}
-
-SessionData::SessionData(size_t blk_sz, size_t blk_num, int _chan)
-    : chan(_chan), max_len(2 * blk_sz * blk_num), enable(true), os(&buf), is(&buf)
-{
-    out_buf = new char[blk_sz];
-    buf.prepare(max_len);
-}
+    gate_level = std::pow(10.0, target.silence_threshold / 10.0) * 32768.0 * 32768.0;
+    silent_frames = 0;
 
-SessionData::~SessionData()
-{
-    delete[] out_buf;
+    // durations beyond one opus frame are sent as multi-frame packets, the receiver path stays the same.
+    static const int durations[] = {5, 10, 20, 40, 60, 80, 100, 120};
+    auto frames = period;
+    if (target.packet_ms > 0)
+    {
+        if (std::find(std::begin(durations), std::end(durations), target.packet_ms) != std::end(durations))
+        {
+            frames = fs / 1000 * target.packet_ms;
+        }
+        else
+        {
+            AUDIO_ERROR_PRINT("unsupported packet duration %d ms, packets follow the capture period\n",
+                              target.packet_ms);
+        }
+    }
+    if (frames != packet_frames)
+    {
+        packet_frames = frames;
+        pcm_fill = 0;
+    }
+    return true;
 }
 
-void SessionData::store_data(const char *data, size_t len)
+void NetEncoder::push(const char *data, size_t len)
 {
-    lock spin(ready);
-    if (buf.size() < max_len)
+    if (!encoder)
     {
-        os.write(data, static_cast<std::streamsize>(len));
+        return;
     }
-}
 
-void SessionData::load_data(size_t len)
-{
-    std::memset(out_buf, 0, len);
-    lock spin(ready);
-    if (buf.size() >= len)
+    if (profile_dirty.exchange(false))
     {
-        is.read(out_buf, static_cast<std::streamsize>(len));
+        apply_profile(false);
     }
-    if (buf.size() > max_len)
+
+    auto input = (const int16_t *)data;
+    auto frames = (int)(len / (head.channel * sizeof(int16_t)));
+    while (frames > 0)
     {
-        buf.consume(max_len);
+        auto count = std::min(frames, packet_frames - pcm_fill);
+        std::memcpy(pcm_buf + pcm_fill * head.channel, input, count * head.channel * sizeof(int16_t));
+        pcm_fill += count;
+        input += count * head.channel;
+        frames -= count;
+        if (pcm_fill == packet_frames)
+        {
+            encode_packet();
+            pcm_fill = 0;
+        }
     }
 }
 
-NetEncoder::NetEncoder(uint8_t _sender, uint8_t _channel, int _period, AudioBandWidth _bandwidth)
-    : head{_sender, _channel, cast_bandwidth_as_uint8(_bandwidth), 1, 0}, period(_period), os(&buf), encoder(nullptr),
-      enc_buf(nullptr)
+asio::streambuf &NetEncoder::prepare(size_t &out_len)
 {
-    buf.prepare(256);
-    auto err = 0;
-    encoder = opus_encoder_create(enum2val(_bandwidth), head.channel, OPUS_APPLICATION_AUDIO, &err);
-    if (err != 0)
+    out_len = 0;
+    if (ready_num > 0)
     {
-        AUDIO_ERROR_PRINT("%s\n", opus_strerror(err));
+        out_len = ready[ready_head];
+        ready_head = (ready_head + 1) % READY_LIMIT;
+        ready_num--;
     }
-    enc_buf = new unsigned char[head.channel * sizeof(int16_t) * period];
+    return buf;
 }
 
-NetEncoder::~NetEncoder()
+void NetEncoder::encode_packet()
 {
-    if (encoder)
+    auto clock = sample_clock;
+    sample_clock += packet_frames;
+
+    // silent periods are dropped before the sequence advances, the receiver sees no loss.
+    auto len = packet_frames * head.channel * sizeof(int16_t);
+    if (profile.silence_gate && is_silent((const char *)pcm_buf, len))
     {
-        opus_encoder_destroy(encoder);
+        resumed = true;
+        return;
     }
 
-    delete[] enc_buf;
-}
+    if (ready_num == READY_LIMIT)
+    {
+        AUDIO_ERROR_PRINT("packets are not drained, dropped\n");
+        return;
+    }
 
-asio::streambuf &NetEncoder::prepare(const char *data, size_t len, size_t &out_len)
-{
-    auto opus_bytes = opus_encode(encoder, (const opus_int16 *)data, period, enc_buf, static_cast<opus_int32>(len));
+    auto compact = profile.compact_header;
+    auto ext = extended.load(std::memory_order_relaxed);
+    auto head_len = (compact ? sizeof(CompactHeader) : sizeof(PacketHeader)) + (ext ? sizeof(PacketExtension) : 0);
+    auto opus_bytes = opus_encode(encoder, pcm_buf, packet_frames, enc_buf,
+                                  static_cast<opus_int32>(AUDIO_PACKET_MAX_BYTES - head_len));
     if (opus_bytes <= 0)
     {
-        out_len = 0;
         AUDIO_ERROR_PRINT("%s\n", opus_strerror(opus_bytes));
-        return buf;
+        return;
+    }
+
+    if (profile.dtx && opus_bytes <= OPUS_DTX_PACKET_BYTES)
+    {
+        resumed = true;
+        return;
     }
 
     head.timestamp =
-        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        std::chrono::duration_cast<std::chrono::microseconds>(media_now().time_since_epoch())
             .count();
     head.sequence++;
-    os.write((const char *)&head, sizeof(head));
+    if (compact)
+    {
+        auto rate = std::find(std::begin(AUDIO_COMPACT_RATES), std::end(AUDIO_COMPACT_RATES), head.fs_rate) -
+                    std::begin(AUDIO_COMPACT_RATES);
+        uint8_t control = AUDIO_COMPACT_VERSION | (uint8_t)(rate << AUDIO_COMPACT_RATE_SHIFT);
+        control |= ext ? AUDIO_COMPACT_EXTENDED : 0;
+        control |= opus_packet_has_lbrr(enc_buf, opus_bytes) > 0 ? AUDIO_COMPACT_FEC : 0;
+        control |= resumed ? AUDIO_COMPACT_RESUMED : 0;
+        CompactHeader compact_head{head.sender, control, (uint16_t)head.sequence, clock};
+        os.write((const char *)&compact_head, sizeof(compact_head));
+    }
+    else
+    {
+        head.enc_fmt = enum2val(AudioEncoderFormat::OPUS) | (ext ? AUDIO_PACKET_EXTENDED : 0);
+        os.write((const char *)&head, sizeof(head));
+    }
+    if (ext)
+    {
+        // the destination is filled in per receiver when the packet is sent.
+        PacketExtension extension{source_id.load(std::memory_order_relaxed), 0};
+        os.write((const char *)&extension, sizeof(extension));
+    }
     os.write((const char *)enc_buf, opus_bytes);
-    out_len = opus_bytes;
-    return buf;
+    ready[(ready_head + ready_num) % READY_LIMIT] = head_len + opus_bytes;
+    ready_num++;
+    resumed = false;
+}
+
+bool NetEncoder::is_silent(const char *data, size_t len)
+{
+    if (len < sizeof(int16_t) || mean_square((const int16_t *)data, len / sizeof(int16_t)) >= gate_level)
+    {
+        silent_frames = 0;
+        return false;
+    }
+
+    silent_frames = std::min(silent_frames + (int)(len / (head.channel * sizeof(int16_t))), fs);
+    return silent_frames > fs * SILENCE_HANGOVER_MS / 1000;
 }
 
-NetDecoder::NetDecoder(uint8_t _token, uint8_t _channel, int _bandwidth)
-    : token(_token), chann(_channel), decoder(nullptr), dec_buf(nullptr), rsc_buf(nullptr),
-      fsi(ceil_div(_bandwidth, 8000) * 8000), fso(_bandwidth), rnow_last(0), snow_last(0), iseq_last(0), pack_lost(0),
+NetDecoder::NetDecoder(uint32_t _token, uint8_t _channel, int _bandwidth, bool _dred)
+    : token(_token), max_chann(_channel), chann(_channel), decoder(nullptr), dec_buf(nullptr), rsc_buf(nullptr),
+      fsi(ceil_div(_bandwidth, 8000) * 8000), fso(_bandwidth), stale(false), fresh(false), iseq_decoded(0), dred_decoder(nullptr),
+      dred(nullptr), dred_seq(0), dred_samples(0), rnow_last(0), snow_last(0), iseq_last(0), pack_lost(0),
       jitter(0), recv_interv(0), send_interv(0), lost_rate(0), avg_jitter(0), avg_recv_interv(0), avg_send_interv(0)
 {
-    auto err = 0;
-    decoder = opus_decoder_create(fsi, chann, &err);
-    if (err != 0)
+    // state for the widest layout is allocated once, a pooled decoder is re-initialized in place.
+    decoder = (OpusDecoder *)new char[opus_decoder_get_size(max_chann)];
+    auto err = opus_decoder_init(decoder, fsi, chann);
+    if (err != OPUS_OK)
     {
         AUDIO_ERROR_PRINT("%s\n", opus_strerror(err));
     }
-    dec_buf = new int16_t[enum2val(AudioBandWidth::Full) * chann * enum2val(AudioPeriodSize::INR_40MS) / 1000];
+    // multi-frame packets decode up to the longest opus packet at once.
+    dec_buf = new int16_t[enum2val(AudioBandWidth::Full) * chann * AUDIO_PACKET_MAX_MS / 1000];
     if (fsi != fso)
     {
-        rsc_buf = new int16_t[enum2val(AudioBandWidth::Full) * chann * enum2val(AudioPeriodSize::INR_40MS) / 1000];
+        auto max_frames = (size_t)fsi * AUDIO_PACKET_MAX_MS / 1000;
+        resampler = std::make_unique<PolyphaseResampler>(fsi, fso, chann, max_frames);
+        rsc_buf = new int16_t[resampler->max_output(max_frames) * chann];
     }
-}
 
-NetDecoder::~NetDecoder()
-{
-    if (decoder)
+#ifdef AUDIO_ENABLE_DRED
+    if (_dred)
     {
-        opus_decoder_destroy(decoder);
+        dred_decoder = opus_dred_decoder_create(&err);
+        dred = opus_dred_alloc(&err);
+        if (dred_decoder && dred)
+        {
+            // the neural concealment that bridges into the redundancy only runs at higher complexity.
+            opus_decoder_ctl(decoder, OPUS_SET_COMPLEXITY(10));
+        }
+        else
+        {
+            AUDIO_ERROR_PRINT("%s\n", opus_strerror(err));
+            opus_dred_decoder_destroy(dred_decoder);
+            opus_dred_free(dred);
+            dred_decoder = nullptr;
+            dred = nullptr;
+        }
     }
+#else
+    (void)_dred;
+#endif
+}
 
+NetDecoder::~NetDecoder()
+{
+#ifdef AUDIO_ENABLE_DRED
+    opus_dred_decoder_destroy(dred_decoder);
+    opus_dred_free(dred);
+#endif
+    delete[](char *) decoder;
     delete[] dec_buf;
     delete[] rsc_buf;
 }
 
 bool NetDecoder::commit(const char *data, size_t len, const char *&out_data, size_t &out_len)
 {
-    auto frame_nums = opus_decode(decoder, (unsigned char *)data + sizeof(PacketHeader),
-                                  static_cast<opus_int32>(len - sizeof(PacketHeader)), dec_buf, 5760, 0);
+    follow_restart(data);
+    fresh = stale;
+    if (stale)
+    {
+        // packets were skipped, start from a clean state instead of overlapping with old audio.
+        opus_decoder_ctl(decoder, OPUS_RESET_STATE);
+        stale = false;
+    }
+
+    auto head_len = PacketHeader::length(data);
+    auto frame_nums = opus_decode(decoder, (unsigned char *)data + head_len, static_cast<opus_int32>(len - head_len),
+                                  dec_buf, fsi * AUDIO_PACKET_MAX_MS / 1000, 0);
     if (frame_nums <= 0)
     {
         return false;
     }
 
-    PacketHeader head{};
-    std::memcpy(&head, data, sizeof(head));
-    auto snow = head.timestamp;
-    auto iseq = head.sequence;
+    update_statistic(data, frame_nums);
+    if (iseq_decoded == 0 || (int32_t)(iseq_last - iseq_decoded) > 0)
+    {
+        iseq_decoded = iseq_last;
+    }
+
+    emit(frame_nums, out_data, out_len);
+    return true;
+}
+
+bool NetDecoder::recover(const char *data, size_t len, uint32_t oldest, uint32_t &seq, const char *&out_data,
+                         size_t &out_len)
+{
+    // nothing to bridge from after skipped packets, and late packets never open a gap.
+    auto iseq = PacketHeader::get_sequence(data, iseq_decoded);
+    if (stale || iseq_decoded == 0 || (int32_t)(iseq - iseq_decoded) <= 1)
+    {
+        return false;
+    }
+
+    if ((int32_t)(oldest - iseq_decoded) > 1)
+    {
+        // audio the playout has passed or would drop is not worth decoding on the receive thread.
+        iseq_decoded = (int32_t)(iseq - oldest) > 0 ? oldest - 1 : iseq - 1;
+        if ((int32_t)(iseq - iseq_decoded) <= 1)
+        {
+            return false;
+        }
+    }
+
+    auto head_len = PacketHeader::length(data);
+    auto payload = (const unsigned char *)data + head_len;
+    auto payload_len = static_cast<opus_int32>(len - head_len);
+    auto frame_size = opus_packet_get_nb_samples(payload, payload_len, fsi);
+    auto missing = (uint64_t)(iseq - iseq_decoded - 1);
+    if (frame_size <= 0)
+    {
+        return false;
+    }
+
+    auto limit = (uint64_t)fsi * DECODER_CONCEAL_MAX_MS / 1000;
+#ifdef AUDIO_ENABLE_DRED
+    if (dred && dred_seq != iseq)
+    {
+        // parsed once per arriving packet and only as far back as the gap reaches.
+        opus_int32 dred_end = 0;
+        auto depth = std::min(missing * frame_size, (uint64_t)fsi * DRED_MAX_DURATION_MS / 1000);
+        auto ret = opus_dred_parse(dred_decoder, dred, payload, payload_len, (opus_int32)depth, fsi, &dred_end, 0);
+        dred_seq = iseq;
+        dred_samples = ret > 0 ? ret : 0;
+    }
+    limit = std::max(limit, (uint64_t)dred_samples);
+#endif
+    if (missing * frame_size > limit)
+    {
+        // longer outages are left to the jitter buffer as silence, concealment would only fade out anyway.
+        return false;
+    }
+
+    // the packet right before this one may travel as in-band fec, older ones come from the deep redundancy
+    // when the sender carries it and are concealed otherwise.
+    int frame_nums = 0;
+    if (missing == 1 && PacketHeader::fec(data) && opus_packet_has_lbrr(payload, payload_len) > 0)
+    {
+        frame_nums = opus_decode(decoder, payload, payload_len, dec_buf, frame_size, 1);
+    }
+#ifdef AUDIO_ENABLE_DRED
+    else if (missing * frame_size <= (uint64_t)dred_samples)
+    {
+        // the offset counts back from the start of the arriving packet.
+        frame_nums = opus_decoder_dred_decode(decoder, dred, (opus_int32)(missing * frame_size), dec_buf, frame_size);
+    }
+#endif
+    else
+    {
+        frame_nums = opus_decode(decoder, nullptr, 0, dec_buf, frame_size, 0);
+    }
+    if (frame_nums <= 0)
+    {
+        return false;
+    }
+
+    seq = ++iseq_decoded;
+    emit(frame_nums, out_data, out_len);
+    return true;
+}
+
+void NetDecoder::skip(const char *data, size_t len)
+{
+    auto head_len = PacketHeader::length(data);
+    auto frame_nums = opus_packet_get_nb_samples((const unsigned char *)data + head_len,
+                                                 static_cast<opus_int32>(len - head_len), fsi);
+    if (frame_nums <= 0)
+    {
+        return;
+    }
+
+    follow_restart(data);
+    update_statistic(data, frame_nums);
+    if (iseq_decoded == 0 || (int32_t)(iseq_last - iseq_decoded) > 0)
+    {
+        iseq_decoded = iseq_last;
+    }
+    stale = true;
+}
+
+void NetDecoder::reset(uint32_t _token, uint8_t _channel)
+{
+    token = _token;
+    chann = std::min(_channel, max_chann);
+    auto err = opus_decoder_init(decoder, fsi, chann);
+    if (err != OPUS_OK)
+    {
+        AUDIO_ERROR_PRINT("%s\n", opus_strerror(err));
+    }
+    if (dred)
+    {
+        opus_decoder_ctl(decoder, OPUS_SET_COMPLEXITY(10));
+    }
+    if (resampler)
+    {
+        resampler->reset(chann);
+    }
+
+    stale = false;
+    fresh = false;
+    iseq_decoded = 0;
+    dred_seq = 0;
+    dred_samples = 0;
+    iseq_last = 0;
+    pack_lost = 0;
+    rnow_last = 0;
+    snow_last = 0;
+    jitter = 0;
+    recv_interv = 0;
+    send_interv = 0;
+
+    std::lock_guard<std::mutex> grd(mtx);
+    lost_rate = 0;
+    avg_jitter = 0;
+    avg_recv_interv = 0;
+    avg_send_interv = 0;
+}
+
+void NetDecoder::follow_restart(const char *data)
+{
+    // the sequence only moves forward otherwise, recovery would stay off until the old one is reached again.
+    auto iseq = PacketHeader::get_sequence(data, iseq_last);
+    if (iseq_last == 0 || (int32_t)(iseq_last - iseq) <= DECODER_RESTART_PACKETS)
+    {
+        return;
+    }
+
+    AUDIO_INFO_PRINT("sender %u restarted at sequence %u\n", token, iseq);
+    stale = true;
+    iseq_decoded = 0;
+    dred_seq = 0;
+    dred_samples = 0;
+    iseq_last = 0;
+    pack_lost = 0;
+    rnow_last = 0;
+    snow_last = 0;
+
+    std::lock_guard<std::mutex> grd(mtx);
+    lost_rate = 0;
+}
+
+void NetDecoder::update_statistic(const char *data, int frame_nums)
+{
+    auto snow = PacketHeader::get_timestamp(data, snow_last);
+    auto iseq = PacketHeader::get_sequence(data, iseq_last);
     auto rnow =
-        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        std::chrono::duration_cast<std::chrono::microseconds>(media_now().time_since_epoch())
             .count();
 
     if (iseq_last != 0)
     {
         auto rinterv = rnow > rnow_last ? (double)(rnow - rnow_last) : 0.0;
         auto sinterv = snow > snow_last ? (double)(snow - snow_last) : 0.0;
-        recv_interv += (rinterv - recv_interv) / 16.0;
-        send_interv += (sinterv - send_interv) / 16.0;
+        if (sinterv <= 2e6 * frame_nums / fsi && !PacketHeader::resumed(data))
+        {
+            // the first packet after a suppressed silence would otherwise skew the interval averages.
+            recv_interv += (rinterv - recv_interv) / 16.0;
+            send_interv += (sinterv - send_interv) / 16.0;
+        }
         jitter += (fabs(rinterv - sinterv) - jitter) / 16.0;
         if (iseq_last + 1 != iseq)
         {
@@ -207,7 +1312,10 @@ bool NetDecoder::commit(const char *data, size_t len, const char *&out_data, siz
     snow_last = snow;
     rnow_last = rnow;
     iseq_last = iseq;
+}
 
+void NetDecoder::emit(int frame_nums, const char *&out_data, size_t &out_len)
+{
     if (fsi == fso)
     {
         out_len = sizeof(opus_int16) * frame_nums * chann;
@@ -215,11 +1323,9 @@ bool NetDecoder::commit(const char *data, size_t len, const char *&out_data, siz
     }
     else
     {
-        out_len = sizeof(opus_int16) * ReSampleS16LE(dec_buf, rsc_buf, fsi, fso, frame_nums, chann) * chann;
+        out_len = sizeof(opus_int16) * resampler->process(dec_buf, frame_nums, rsc_buf) * chann;
         out_data = (const char *)rsc_buf;
     }
-
-    return true;
 }
 
 ChannelInfo NetDecoder::statistic_info()
@@ -228,10 +1334,30 @@ ChannelInfo NetDecoder::statistic_info()
     return {token, lost_rate, avg_jitter, avg_recv_interv, avg_send_interv};
 }
 
+uint32_t NetDecoder::sequence() const
+{
+    return iseq_last;
+}
+
+bool NetDecoder::restarted() const
+{
+    return fresh;
+}
+
+double NetDecoder::current_jitter() const
+{
+    return jitter;
+}
+
 LocEncoder::LocEncoder(int inSampleRate, int outSampleRate, int channel)
-    : fsi(inSampleRate), fso(outSampleRate), chan(channel), src_buf(nullptr)
+    : fsi(inSampleRate), fso(outSampleRate), chan(channel),
+      max_frames((size_t)2 * inSampleRate * enum2val(AudioPeriodSize::INR_40MS) / 1000), src_buf(nullptr)
 {
-    src_buf = new int16_t[8 * enum2val(AudioBandWidth::Full) * chan * enum2val(AudioPeriodSize::INR_40MS) / 1000];
+    if (fsi != fso)
+    {
+        resampler = std::make_unique<PolyphaseResampler>(fsi, fso, chan, max_frames);
+        src_buf = new int16_t[resampler->max_output(max_frames) * chan];
+    }
 }
 
 LocEncoder::~LocEncoder()
@@ -239,6 +1365,19 @@ LocEncoder::~LocEncoder()
     delete[] src_buf;
 }
 
+bool LocEncoder::match(int input_fs, int channel) const
+{
+    return fsi == input_fs && chan == channel;
+}
+
+void LocEncoder::reset()
+{
+    if (resampler)
+    {
+        resampler->reset(chan);
+    }
+}
+
 bool LocEncoder::commit(int16_t *input, size_t input_len, int16_t *&output, size_t &output_size)
 {
     if (!input)
@@ -252,7 +1391,155 @@ bool LocEncoder::commit(int16_t *input, size_t input_len, int16_t *&output, size
         output_size = input_len;
         return true;
     }
-    output_size = ReSampleS16LE(input, src_buf, fsi, fso, input_len, chan);
+    output_size = resampler->process(input, std::min(input_len, max_frames), src_buf);
     output = src_buf;
     return true;
 }
+
+#ifdef AUDIO_BATCH_IO
+int batch_receive(int fd, char *bufs, size_t mtu, size_t *lens, int batch)
+{
+    mmsghdr msgs[AUDIO_BATCH_SIZE];
+    iovec iovs[AUDIO_BATCH_SIZE];
+    batch = std::min(batch, AUDIO_BATCH_SIZE);
+    std::memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < batch; i++)
+    {
+        iovs[i].iov_base = bufs + i * mtu;
+        iovs[i].iov_len = mtu;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    auto count = recvmmsg(fd, msgs, batch, MSG_DONTWAIT, nullptr);
+    if (count <= 0)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        lens[i] = msgs[i].msg_len;
+    }
+    return count;
+}
+
+int batch_send_to(int fd, const void *data, size_t len, const std::vector<asio::ip::udp::endpoint> &dests,
+                  const uint32_t *dest_ids)
+{
+    mmsghdr msgs[AUDIO_BATCH_SIZE];
+    iovec iov{const_cast<void *>(data), len};
+    // header and payload are shared, only the destination id differs between the copies.
+    iovec iovs[AUDIO_BATCH_SIZE][3];
+    auto split = dest_ids != nullptr && len >= sizeof(CompactHeader) && PacketHeader::extended((const char *)data);
+    auto dest_offset = split ? PacketHeader::length((const char *)data) - sizeof(uint32_t) : 0;
+    int sent = 0;
+    for (size_t base = 0; base < dests.size(); base += AUDIO_BATCH_SIZE)
+    {
+        auto count = (int)std::min(dests.size() - base, (size_t)AUDIO_BATCH_SIZE);
+        std::memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < count; i++)
+        {
+            msgs[i].msg_hdr.msg_name = const_cast<sockaddr *>(dests[base + i].data());
+            msgs[i].msg_hdr.msg_namelen = (socklen_t)dests[base + i].size();
+            if (split)
+            {
+                iovs[i][0] = {const_cast<void *>(data), dest_offset};
+                iovs[i][1] = {const_cast<uint32_t *>(dest_ids + base + i), sizeof(uint32_t)};
+                iovs[i][2] = {(char *)const_cast<void *>(data) + dest_offset + sizeof(uint32_t),
+                              len - dest_offset - sizeof(uint32_t)};
+                msgs[i].msg_hdr.msg_iov = iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 3;
+            }
+            else
+            {
+                msgs[i].msg_hdr.msg_iov = &iov;
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+        }
+
+        auto result = sendmmsg(fd, msgs, count, MSG_DONTWAIT);
+        if (result < 0)
+        {
+            break;
+        }
+        sent += result;
+    }
+    return sent;
+}
+#endif
+
+void send_to_all(asio::ip::udp::socket &sock, const char *data, size_t len,
+                 const std::vector<asio::ip::udp::endpoint> &dests, const uint32_t *dest_ids)
+{
+    if (dest_ids && !PacketHeader::extended(data))
+    {
+        dest_ids = nullptr;
+    }
+#ifdef AUDIO_BATCH_IO
+    batch_send_to(sock.native_handle(), data, len, dests, dest_ids);
+#else
+    // this may run in the capture callback, a full send buffer drops the datagram like MSG_DONTWAIT above
+    // instead of stalling the audio thread.
+    asio::error_code ec;
+    if (!sock.non_blocking())
+    {
+        sock.non_blocking(true, ec);
+    }
+    for (size_t i = 0; i < dests.size(); i++)
+    {
+        if (!dest_ids)
+        {
+            sock.send_to(asio::buffer(data, len), dests[i], 0, ec);
+            continue;
+        }
+        // the destination id closes the extension, splice it in between header and payload.
+        auto split = PacketHeader::length(data) - sizeof(uint32_t);
+        std::array<asio::const_buffer, 3> bufs{asio::buffer(data, split), asio::buffer(&dest_ids[i], sizeof(uint32_t)),
+                                               asio::buffer(data + split + sizeof(uint32_t),
+                                                            len - split - sizeof(uint32_t))};
+        sock.send_to(bufs, dests[i], 0, ec);
+    }
+#endif
+}
+
+#ifdef AUDIO_REUSEPORT
+bool open_port_shards(asio::io_context &ctx, uint16_t port, int count, bool steer,
+                      std::vector<std::unique_ptr<asio::ip::udp::socket>> &socks)
+{
+    socks.clear();
+    asio::error_code ec;
+    for (int i = 0; i < count; i++)
+    {
+        auto sock = std::make_unique<asio::ip::udp::socket>(ctx);
+        // a single shard binds exclusively, so that a second stream on the same port still fails to start.
+        int one = 1;
+        if (sock->open(asio::ip::udp::v4(), ec) ||
+            (count > 1 && setsockopt(sock->native_handle(), SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) ||
+            sock->bind(asio::ip::udp::endpoint(asio::ip::udp::v4(), port), ec))
+        {
+            AUDIO_ERROR_PRINT("shard %d on port %u: %s\n", i, port, ec ? ec.message().c_str() : strerror(errno));
+            socks.clear();
+            return false;
+        }
+        socks.push_back(std::move(sock));
+    }
+
+    if (steer && count > 1)
+    {
+        // the program sees the udp payload, shard = sender id % count in bind order.
+        sock_filter code[] = {
+            {BPF_LD | BPF_B | BPF_ABS, 0, 0, 0},
+            {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)count},
+            {BPF_RET | BPF_A, 0, 0, 0},
+        };
+        sock_fprog prog{sizeof(code) / sizeof(code[0]), code};
+        if (setsockopt(socks[0]->native_handle(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+        {
+            // the address hash still keeps a sender on one shard as long as its source port is stable.
+            AUDIO_ERROR_PRINT("sender steering unavailable: %s\n", strerror(errno));
+        }
+    }
+    return true;
+}
+#endif
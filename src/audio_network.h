@@ -13,15 +13,48 @@
 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
 |                           timestamp                           |
 +=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+|                  source id (extended only)                    |
++-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+|               destination id (extended only)                  |
++=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
 |                            payload                            |
 |                             ....                              |
 +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ the extended fields are present when the top bit of the encoder format is set.
+
+                    Compact Frame Format
+ 0                   1                   2                   3
+ 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
++-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+|  sender id    |0 1|X|rate |F|R|0|      sequence (low 16 bits)   |
++-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+|                   timestamp (sample clock)                    |
++=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+|        source id, destination id (extended only)             |
++=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+|                         opus payload                          |
++-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ version bits 01 can't occur in the channel byte of the full header. rate indexes 8/16/24/48 khz,
+ the channel count is read from the opus toc. F: in-band fec present, R: first packet after a
+ transmission pause, the last bit is reserved and sent as 0. the timestamp wraps about daily at 48 khz,
+ receivers extend it like the sequence.
 */
 
 #include "asio.hpp"
 #include "audio_interface.h"
 #include "opus.h"
 
+class PolyphaseResampler;
+class VarispeedResampler;
+
+#if defined(__linux__) && !defined(AUDIO_DISABLE_BATCH_IO)
+#define AUDIO_BATCH_IO
+#endif
+
+#if defined(__linux__) && !defined(AUDIO_DISABLE_REUSEPORT)
+#define AUDIO_REUSEPORT
+#endif
+
 #define AUDIO_INFO_PRINT(fmt, ...) printf("[INF] %s(%d): " fmt, __FUNCTION__, __LINE__, ##__VA_ARGS__)
 #define AUDIO_ERROR_PRINT(fmt, ...) printf("[ERR] %s(%d): " fmt, __FUNCTION__, __LINE__, ##__VA_ARGS__)
 
@@ -88,9 +121,23 @@ inline constexpr AudioBandWidth cast_uint8_as_bandwidth(uint8_t sample_rate)
     }
 }
 
+// the media timeline, the wall clock unless an offline render has bound a virtual clock to the thread.
+std::chrono::steady_clock::time_point media_now();
+
+void bind_virtual_clock(const std::chrono::steady_clock::time_point *now);
+
+// receivers bound to the shared port dispatch extended packets by destination id.
+constexpr uint16_t AUDIO_SHARED_PORT = 0xcd00;
+
+// receivers read datagrams into buffers of this size, the encoder keeps every packet within it.
+constexpr size_t AUDIO_PACKET_MAX_BYTES = 2880;
+
+// the longest opus packet, multi-frame packets included.
+constexpr int AUDIO_PACKET_MAX_MS = 120;
+
 struct ChannelInfo
 {
-    uint8_t token;
+    uint32_t token;
     double lost_rate;
     double jitter;
     double recv_interv;
@@ -106,30 +153,124 @@ struct PacketHeader
     uint32_t sequence;
     uint64_t timestamp;
 
+    // accepts the full and the compact format, the accessors below read both.
     static bool validate(const char *data, size_t len);
+
+    static bool compact(const char *data);
+
+    static bool extended(const char *data);
+
+    static size_t length(const char *data);
+
+    static uint8_t channels(const char *data);
+
+    // compact packets carry 16 bits, they are extended to the sequence closest to reference.
+    static uint32_t get_sequence(const char *data, uint32_t reference);
+
+    // microseconds on the sender timeline. the 32-bit sample clock of compact packets is extended to
+    // the time closest to reference.
+    static uint64_t get_timestamp(const char *data, uint64_t reference);
+
+    static bool resumed(const char *data);
+
+    // false only when a compact header says the payload carries no in-band fec.
+    static bool fec(const char *data);
+
+    // legacy packets report their 8-bit sender id.
+    static uint32_t source(const char *data);
+
+    static uint32_t destination(const char *data);
+
+    static void set_destination(char *data, uint32_t id);
 };
 
-class SessionData
+struct CompactHeader
 {
-    struct lock
-    {
-        explicit lock(std::atomic_flag &flag) : m_flag(flag)
-        {
-            while (m_flag.test_and_set(std::memory_order_acquire))
-                ;
-        }
+    uint8_t sender;
+    uint8_t control;
+    uint16_t sequence;
+    uint32_t timestamp;
+};
+
+struct PacketExtension
+{
+    uint32_t source;
+    uint32_t destination;
+};
+
+class SpscRing
+{
+public:
+    explicit SpscRing(size_t min_capacity);
+
+    ~SpscRing();
+
+    bool push(const int16_t *head, size_t head_len, const int16_t *data, size_t len);
+
+    bool pop(int16_t *data, size_t len);
+
+    size_t skip(size_t len);
+
+    size_t size() const;
+
+    void reset();
+
+private:
+    static constexpr size_t CACHE_LINE_SIZE = 64;
+
+    // producer and consumer indices live on separate cache lines, each side keeps
+    // a private copy of the other index to avoid touching the shared line per call.
+    std::atomic<size_t> head_idx;
+    size_t tail_cache;
+    char pad0[CACHE_LINE_SIZE];
+    std::atomic<size_t> tail_idx;
+    size_t head_cache;
+    char pad1[CACHE_LINE_SIZE];
+    const size_t capacity;
+    const size_t mask;
+    int16_t *ring;
+};
+
+// wakes a blocked consumer thread. post() takes no lock and at most one system call, the audio callback may use it.
+class WakeSignal
+{
+public:
+    WakeSignal();
+
+    ~WakeSignal();
+
+    void post();
+
+    void wait();
+
+private:
+    void *handle;
+};
+
+class DriftController
+{
+public:
+    DriftController(int fs, int ps);
+
+    double update(size_t fill, size_t target);
 
-        ~lock()
-        {
-            m_flag.clear(std::memory_order_release);
-        }
+    void resync();
 
-    private:
-        std::atomic_flag &m_flag;
-    };
+    void reset();
+
+private:
+    const double fs;
+    const double dt;
+    const double alpha;
+    bool primed;
+    double level;
+    double integral;
+};
 
+class SessionData
+{
 public:
-    SessionData(size_t blk_sz, size_t blk_num, int _chan);
+    SessionData(size_t blk_sz, size_t blk_num, int _chan, int _fs = 0);
 
     ~SessionData();
 
@@ -137,17 +278,95 @@ public:
 
     void load_data(size_t len);
 
+    void skip_data();
+
+    void reset();
+
 public:
     const int chan;
     const size_t max_len;
-    asio::streambuf buf;
     char *out_buf;
-    bool enable;
+    std::atomic_bool enable;
+    std::atomic_bool selected;
+    std::atomic<float> level;
 
 private:
-    std::atomic_flag ready = ATOMIC_FLAG_INIT;
-    std::ostream os;
-    std::istream is;
+    SpscRing buf;
+
+    // only set when the session is fed by a foreign clock.
+    std::unique_ptr<DriftController> drift;
+    std::unique_ptr<VarispeedResampler> varispeed;
+    int16_t *pull_buf;
+};
+
+class JitterBuffer
+{
+public:
+    JitterBuffer(int _fs, int _ps, int _chan);
+
+    ~JitterBuffer();
+
+    // level_periods counts the packets this one stands for in the speaker level, 0 leaves the level alone.
+    void store_data(uint32_t seq, const char *data, size_t len, int level_periods = 1);
+
+    void load_data(size_t len);
+
+    void skip_data();
+
+    void update_jitter(double jitter_us);
+
+    // the oldest sequence before seq that recovered audio can still reach the playout with, seq itself
+    // while nothing is buffered.
+    uint32_t playable_since(uint32_t seq) const;
+
+    void reset(int _chan);
+
+public:
+    const int max_chan;
+    int chan;
+    char *out_buf;
+    std::atomic_bool enable;
+    std::atomic_bool selected;
+    std::atomic<float> level;
+
+private:
+    void place_packet(uint32_t seq, const int16_t *data, size_t frames);
+
+    void drop_frames(uint64_t pos);
+
+    void update_target();
+
+    void publish_window();
+
+private:
+    const int fs;
+    const int ps;
+    const size_t capacity;
+    SpscRing inbound;
+    std::atomic<size_t> jitter_frames;
+    // published by the consumer once per period, the producer bounds packet recovery with them.
+    std::atomic<uint32_t> play_seq;
+    std::atomic<uint32_t> play_depth;
+
+    // owned by the consumer, packets are reordered on the playout side.
+    int16_t *ring;
+    int16_t *pkt_buf;
+    int16_t *pull_buf;
+    DriftController drift;
+    std::unique_ptr<VarispeedResampler> varispeed;
+    bool primed;
+    bool buffering;
+    uint32_t seq_last;
+    uint64_t seq_ext;
+    uint64_t read_pos;
+    uint64_t write_end;
+    // end position of the newest packet, the next one in sequence is placed right after it.
+    uint64_t last_end;
+    // positions of the newest sequences, late and duplicate packets land where their sequence was placed.
+    uint64_t *slot_ext;
+    uint64_t *slot_pos;
+    size_t pkt_frames;
+    size_t target;
 };
 
 class LocEncoder
@@ -158,50 +377,134 @@ public:
 
     bool commit(int16_t *input, size_t input_len, int16_t *&output, size_t &output_size);
 
+    bool match(int input_fs, int channel) const;
+
+    void reset();
+
 private:
     const int fsi;
     const int fso;
     const int chan;
+    const size_t max_frames;
 
+    std::unique_ptr<PolyphaseResampler> resampler;
     int16_t *src_buf;
 };
 
 class NetEncoder
 {
 public:
-    NetEncoder(uint8_t _sender, uint8_t _channel, int _period, AudioBandWidth _bandwidth);
+    NetEncoder(uint8_t _sender, uint8_t _channel, int _period, AudioBandWidth _bandwidth,
+               const AudioEncoderProfile &_profile);
     ~NetEncoder();
 
-    asio::streambuf &prepare(const char *data, size_t len, size_t &out_len);
+    // gathers one capture period, a packet is encoded whenever the packet duration is complete.
+    void push(const char *data, size_t len);
+
+    // the next ready packet sits at the front of the buffer, out_len is 0 once none is left.
+    asio::streambuf &prepare(size_t &out_len);
+
+    void set_profile(const AudioEncoderProfile &_profile);
+
+    void set_source(uint32_t id);
+
+    void enable_extension();
+
+private:
+    bool apply_profile(bool init);
+
+    bool configure(const AudioEncoderProfile &target, bool reinit);
+
+    bool is_silent(const char *data, size_t len);
+
+    void encode_packet();
 
 private:
+    static constexpr int READY_LIMIT = 16;
+
     const int period;
+    const int fs;
     PacketHeader head;
+    std::atomic<uint32_t> source_id;
+    std::atomic_bool extended;
     asio::streambuf buf;
     std::ostream os;
     OpusEncoder *encoder;
     unsigned char *enc_buf;
+
+    // capture periods are gathered until a packet is complete, packet_frames may span several periods.
+    int packet_frames;
+    int pcm_fill;
+    int16_t *pcm_buf;
+    size_t ready[READY_LIMIT];
+    int ready_head;
+    int ready_num;
+    // the compact header stamps packets with the sample clock, which keeps running through pauses.
+    uint32_t sample_clock;
+    bool resumed;
+
+    // written by the control thread, picked up by prepare() on the encoding thread.
+    std::mutex profile_mtx;
+    std::atomic_bool profile_dirty;
+    AudioEncoderProfile pending;
+    AudioEncoderProfile profile;
+    double gate_level;
+    int silent_frames;
 };
 
 class NetDecoder
 {
 public:
-    NetDecoder(uint8_t _token, uint8_t _channel, int _bandwidth);
+    NetDecoder(uint32_t _token, uint8_t _channel, int _bandwidth, bool _dred = false);
     ~NetDecoder();
 
     bool commit(const char *data, size_t len, const char *&out_data, size_t &out_len);
 
+    // fills one missing packet before data per call, from in-band fec or by concealment, until the gap is closed.
+    // sequences before oldest are left out, only the newest part of a long gap is rebuilt.
+    bool recover(const char *data, size_t len, uint32_t oldest, uint32_t &seq, const char *&out_data,
+                 size_t &out_len);
+
+    void skip(const char *data, size_t len);
+
+    void reset(uint32_t _token, uint8_t _channel);
+
     ChannelInfo statistic_info();
 
+    uint32_t sequence() const;
+
+    // the last commit started from a reset state, its output ramps in from silence.
+    bool restarted() const;
+
+    double current_jitter() const;
+
 private:
-    const uint8_t token;
-    const uint8_t chann;
+    void follow_restart(const char *data);
+
+    void update_statistic(const char *data, int frame_nums);
+
+    void emit(int frame_nums, const char *&out_data, size_t &out_len);
+
+private:
+    uint32_t token;
+    const uint8_t max_chann;
+    uint8_t chann;
 
     OpusDecoder *decoder;
     opus_int16 *dec_buf;
     opus_int16 *rsc_buf;
+    std::unique_ptr<PolyphaseResampler> resampler;
     int fsi;
     int fso;
+    bool stale;
+    bool fresh;
+    uint32_t iseq_decoded;
+
+    // deep redundancy of the packet that closes a gap is parsed once and shared by the recovered packets.
+    OpusDREDDecoder *dred_decoder;
+    OpusDRED *dred;
+    uint32_t dred_seq;
+    int dred_samples;
 
     uint32_t iseq_last;
     uint32_t pack_lost;
@@ -218,4 +521,30 @@ private:
     double avg_send_interv;
 };
 
+#ifdef AUDIO_BATCH_IO
+constexpr int AUDIO_BATCH_SIZE = 32;
+
+// drain up to batch datagrams of at most mtu bytes each into consecutive slots of bufs.
+int batch_receive(int fd, char *bufs, size_t mtu, size_t *lens, int batch);
+
+// send one datagram to every endpoint with as few syscalls as possible.
+// for extended packets dest_ids[i] is spliced into the destination field of the copy sent to dests[i].
+int batch_send_to(int fd, const void *data, size_t len, const std::vector<asio::ip::udp::endpoint> &dests,
+                  const uint32_t *dest_ids = nullptr);
+#endif
+
+// send one packet to every endpoint, batched where the platform allows it. never blocks, datagrams that
+// don't fit into the socket buffer are dropped.
+// extended packets get dest_ids[i] spliced into their destination field, like batch_send_to.
+void send_to_all(asio::ip::udp::socket &sock, const char *data, size_t len,
+                 const std::vector<asio::ip::udp::endpoint> &dests, const uint32_t *dest_ids = nullptr);
+
+#ifdef AUDIO_REUSEPORT
+// bind count sockets to one port with SO_REUSEPORT, a single socket binds without it. the kernel spreads
+// datagrams over them by address hash, with steer the sender id byte picks the socket so a sender never
+// moves between shards.
+bool open_port_shards(asio::io_context &ctx, uint16_t port, int count, bool steer,
+                      std::vector<std::unique_ptr<asio::ip::udp::socket>> &socks);
+#endif
+
 #endif
\ No newline at end of file
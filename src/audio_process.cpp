@@ -1,5 +1,29 @@
 #include "audio_process.h"
+#include <cmath>
+#include <cstring>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define AUDIO_MIX_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define AUDIO_MIX_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(AUDIO_MIX_X86) && (defined(__GNUC__) || defined(__clang__))
+#define AUDIO_TARGET_SSE2 __attribute__((target("sse2")))
+#define AUDIO_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define AUDIO_TARGET_SSE2
+#define AUDIO_TARGET_AVX2
+#endif
 
 #define SCALEDIFF32(A, B, C) (C + (B >> 16) * A + (((uint32_t)(B & 0x0000FFFF) * A) >> 16))
 
@@ -9,27 +33,38 @@ constexpr int16_t clamp_s16(int32_t v)
                                                                 : v);
 }
 
-void mix_channels(const int16_t *ssrc, int out_chan, int ssrc_chan, int frames_num, int16_t *output)
+namespace
 {
-    if (out_chan == ssrc_chan)
+    // all kernels produce the same result: saturating add, stereo is folded by (l + r) / 2.
+    struct MixKernels
     {
-        for (auto i = 0; i < frames_num * ssrc_chan; i++)
+        void (*same)(const int16_t *ssrc, int samples, int16_t *output);
+        void (*down)(const int16_t *ssrc, int frames, int16_t *output);
+        void (*up)(const int16_t *ssrc, int frames, int16_t *output);
+        const char *name;
+    };
+
+    void mix_same_scalar(const int16_t *ssrc, int samples, int16_t *output)
+    {
+        for (auto i = 0; i < samples; i++)
         {
             auto res = (int32_t)output[i] + (int32_t)ssrc[i];
             output[i] = clamp_s16(res);
         }
     }
-    else if (out_chan == 1 && ssrc_chan == 2)
+
+    void mix_down_scalar(const int16_t *ssrc, int frames, int16_t *output)
     {
-        for (auto i = 0; i < frames_num; i++)
+        for (auto i = 0; i < frames; i++)
         {
             auto res = (int32_t)output[i] + ((int32_t)ssrc[2 * i] + (int32_t)ssrc[2 * i + 1]) / 2;
             output[i] = clamp_s16(res);
         }
     }
-    else if (out_chan == 2 && ssrc_chan == 1)
+
+    void mix_up_scalar(const int16_t *ssrc, int frames, int16_t *output)
     {
-        for (auto i = 0; i < frames_num; i++)
+        for (auto i = 0; i < frames; i++)
         {
             auto res = (int32_t)output[2 * i] + (int32_t)ssrc[i];
             output[2 * i] = clamp_s16(res);
@@ -37,6 +72,242 @@ void mix_channels(const int16_t *ssrc, int out_chan, int ssrc_chan, int frames_n
             output[2 * i + 1] = clamp_s16(res);
         }
     }
+
+#if defined(AUDIO_MIX_X86)
+    AUDIO_TARGET_SSE2 inline __m128i half_pairs_sse2(__m128i v)
+    {
+        // sum adjacent l/r pairs in 32 bits and halve, rounding toward zero like the scalar path.
+        auto sum = _mm_madd_epi16(v, _mm_set1_epi16(1));
+        return _mm_srai_epi32(_mm_add_epi32(sum, _mm_srli_epi32(sum, 31)), 1);
+    }
+
+    AUDIO_TARGET_SSE2 void mix_same_sse2(const int16_t *ssrc, int samples, int16_t *output)
+    {
+        auto i = 0;
+        for (; i + 8 <= samples; i += 8)
+        {
+            auto a = _mm_loadu_si128((const __m128i *)(output + i));
+            auto b = _mm_loadu_si128((const __m128i *)(ssrc + i));
+            _mm_storeu_si128((__m128i *)(output + i), _mm_adds_epi16(a, b));
+        }
+        mix_same_scalar(ssrc + i, samples - i, output + i);
+    }
+
+    AUDIO_TARGET_SSE2 void mix_down_sse2(const int16_t *ssrc, int frames, int16_t *output)
+    {
+        auto i = 0;
+        for (; i + 8 <= frames; i += 8)
+        {
+            auto lo = half_pairs_sse2(_mm_loadu_si128((const __m128i *)(ssrc + 2 * i)));
+            auto hi = half_pairs_sse2(_mm_loadu_si128((const __m128i *)(ssrc + 2 * i + 8)));
+            auto a = _mm_loadu_si128((const __m128i *)(output + i));
+            _mm_storeu_si128((__m128i *)(output + i), _mm_adds_epi16(a, _mm_packs_epi32(lo, hi)));
+        }
+        mix_down_scalar(ssrc + 2 * i, frames - i, output + i);
+    }
+
+    AUDIO_TARGET_SSE2 void mix_up_sse2(const int16_t *ssrc, int frames, int16_t *output)
+    {
+        auto i = 0;
+        for (; i + 8 <= frames; i += 8)
+        {
+            auto b = _mm_loadu_si128((const __m128i *)(ssrc + i));
+            auto a0 = _mm_loadu_si128((const __m128i *)(output + 2 * i));
+            auto a1 = _mm_loadu_si128((const __m128i *)(output + 2 * i + 8));
+            _mm_storeu_si128((__m128i *)(output + 2 * i), _mm_adds_epi16(a0, _mm_unpacklo_epi16(b, b)));
+            _mm_storeu_si128((__m128i *)(output + 2 * i + 8), _mm_adds_epi16(a1, _mm_unpackhi_epi16(b, b)));
+        }
+        mix_up_scalar(ssrc + i, frames - i, output + 2 * i);
+    }
+
+    AUDIO_TARGET_AVX2 inline __m256i half_pairs_avx2(__m256i v)
+    {
+        auto sum = _mm256_madd_epi16(v, _mm256_set1_epi16(1));
+        return _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_srli_epi32(sum, 31)), 1);
+    }
+
+    AUDIO_TARGET_AVX2 void mix_same_avx2(const int16_t *ssrc, int samples, int16_t *output)
+    {
+        auto i = 0;
+        for (; i + 16 <= samples; i += 16)
+        {
+            auto a = _mm256_loadu_si256((const __m256i *)(output + i));
+            auto b = _mm256_loadu_si256((const __m256i *)(ssrc + i));
+            _mm256_storeu_si256((__m256i *)(output + i), _mm256_adds_epi16(a, b));
+        }
+        mix_same_scalar(ssrc + i, samples - i, output + i);
+    }
+
+    AUDIO_TARGET_AVX2 void mix_down_avx2(const int16_t *ssrc, int frames, int16_t *output)
+    {
+        auto i = 0;
+        for (; i + 16 <= frames; i += 16)
+        {
+            auto lo = half_pairs_avx2(_mm256_loadu_si256((const __m256i *)(ssrc + 2 * i)));
+            auto hi = half_pairs_avx2(_mm256_loadu_si256((const __m256i *)(ssrc + 2 * i + 16)));
+            // packs works per 128-bit lane, restore frame order afterwards.
+            auto mono = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+            auto a = _mm256_loadu_si256((const __m256i *)(output + i));
+            _mm256_storeu_si256((__m256i *)(output + i), _mm256_adds_epi16(a, mono));
+        }
+        mix_down_scalar(ssrc + 2 * i, frames - i, output + i);
+    }
+
+    AUDIO_TARGET_AVX2 void mix_up_avx2(const int16_t *ssrc, int frames, int16_t *output)
+    {
+        auto i = 0;
+        for (; i + 16 <= frames; i += 16)
+        {
+            auto b = _mm256_loadu_si256((const __m256i *)(ssrc + i));
+            auto lo = _mm256_unpacklo_epi16(b, b);
+            auto hi = _mm256_unpackhi_epi16(b, b);
+            auto a0 = _mm256_loadu_si256((const __m256i *)(output + 2 * i));
+            auto a1 = _mm256_loadu_si256((const __m256i *)(output + 2 * i + 16));
+            _mm256_storeu_si256((__m256i *)(output + 2 * i),
+                                _mm256_adds_epi16(a0, _mm256_permute2x128_si256(lo, hi, 0x20)));
+            _mm256_storeu_si256((__m256i *)(output + 2 * i + 16),
+                                _mm256_adds_epi16(a1, _mm256_permute2x128_si256(lo, hi, 0x31)));
+        }
+        mix_up_scalar(ssrc + i, frames - i, output + 2 * i);
+    }
+
+    bool cpu_support_avx2()
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+        {
+            return false;
+        }
+        __cpuid(info, 1);
+        // osxsave and avx, then check the os saves ymm state.
+        if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 0x6) != 0x6)
+        {
+            return false;
+        }
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+
+    bool cpu_support_sse2()
+    {
+#if defined(__x86_64__) || defined(_M_X64)
+        return true;
+#elif defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        return (info[3] & (1 << 26)) != 0;
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+#endif
+    }
+#endif
+
+#if defined(AUDIO_MIX_NEON)
+    void mix_same_neon(const int16_t *ssrc, int samples, int16_t *output)
+    {
+        auto i = 0;
+        for (; i + 8 <= samples; i += 8)
+        {
+            vst1q_s16(output + i, vqaddq_s16(vld1q_s16(output + i), vld1q_s16(ssrc + i)));
+        }
+        mix_same_scalar(ssrc + i, samples - i, output + i);
+    }
+
+    inline int32x4_t half_sum_neon(int32x4_t sum)
+    {
+        auto sign = vreinterpretq_s32_u32(vshrq_n_u32(vreinterpretq_u32_s32(sum), 31));
+        return vshrq_n_s32(vaddq_s32(sum, sign), 1);
+    }
+
+    void mix_down_neon(const int16_t *ssrc, int frames, int16_t *output)
+    {
+        auto i = 0;
+        for (; i + 8 <= frames; i += 8)
+        {
+            auto lr = vld2q_s16(ssrc + 2 * i);
+            auto lo = half_sum_neon(vaddl_s16(vget_low_s16(lr.val[0]), vget_low_s16(lr.val[1])));
+            auto hi = half_sum_neon(vaddl_s16(vget_high_s16(lr.val[0]), vget_high_s16(lr.val[1])));
+            auto mono = vcombine_s16(vmovn_s32(lo), vmovn_s32(hi));
+            vst1q_s16(output + i, vqaddq_s16(vld1q_s16(output + i), mono));
+        }
+        mix_down_scalar(ssrc + 2 * i, frames - i, output + i);
+    }
+
+    void mix_up_neon(const int16_t *ssrc, int frames, int16_t *output)
+    {
+        auto i = 0;
+        for (; i + 8 <= frames; i += 8)
+        {
+            auto b = vld1q_s16(ssrc + i);
+            auto dup = vzipq_s16(b, b);
+            vst1q_s16(output + 2 * i, vqaddq_s16(vld1q_s16(output + 2 * i), dup.val[0]));
+            vst1q_s16(output + 2 * i + 8, vqaddq_s16(vld1q_s16(output + 2 * i + 8), dup.val[1]));
+        }
+        mix_up_scalar(ssrc + i, frames - i, output + 2 * i);
+    }
+#endif
+
+    MixKernels select_mix_kernels()
+    {
+#if defined(AUDIO_MIX_X86)
+        if (cpu_support_avx2())
+        {
+            return {mix_same_avx2, mix_down_avx2, mix_up_avx2, "avx2"};
+        }
+        if (cpu_support_sse2())
+        {
+            return {mix_same_sse2, mix_down_sse2, mix_up_sse2, "sse2"};
+        }
+#elif defined(AUDIO_MIX_NEON)
+        return {mix_same_neon, mix_down_neon, mix_up_neon, "neon"};
+#endif
+        return {mix_same_scalar, mix_down_scalar, mix_up_scalar, "scalar"};
+    }
+
+    const MixKernels mix_kernels = select_mix_kernels();
+} // namespace
+
+void mix_channels(const int16_t *ssrc, int out_chan, int ssrc_chan, int frames_num, int16_t *output)
+{
+    if (out_chan == ssrc_chan)
+    {
+        mix_kernels.same(ssrc, frames_num * ssrc_chan, output);
+    }
+    else if (out_chan == 1 && ssrc_chan == 2)
+    {
+        mix_kernels.down(ssrc, frames_num, output);
+    }
+    else if (out_chan == 2 && ssrc_chan == 1)
+    {
+        mix_kernels.up(ssrc, frames_num, output);
+    }
+}
+
+const char *mix_channels_kernel()
+{
+    return mix_kernels.name;
+}
+
+double mean_square(const int16_t *pcm, size_t samples)
+{
+    if (samples == 0)
+    {
+        return 0;
+    }
+
+    int64_t energy = 0;
+    for (size_t i = 0; i < samples; i++)
+    {
+        energy += (int32_t)pcm[i] * pcm[i];
+    }
+    return (double)energy / samples;
 }
 
 static constexpr uint16_t ALLPASS_COFF1[3] = {3284, 24441, 49528};
@@ -184,7 +455,9 @@ void decimator_3(const int16_t *in, size_t len, int16_t *out, int32_t *filtState
 }
 
 static constexpr auto RS_BLKSIZE = 4;
+#ifndef M_PI
 static constexpr auto M_PI = 3.141592653589793;
+#endif
 
 inline static double sinc(double x)
 {
@@ -313,3 +586,287 @@ double SincInterpolator::kernel_func(double x, double cutoff) const
     }
     return 0.0;
 }
+
+static constexpr auto PPR_ZERO_CROSSINGS = 16;
+static constexpr auto PPR_MAX_PHASES = 1024;
+static constexpr auto PPR_ROLLOFF = 0.92;
+static constexpr auto PPR_KAISER_BETA = 8.6;
+
+static double bessel_i0(double x)
+{
+    auto sum = 1.0;
+    auto term = 1.0;
+    for (int k = 1; k < 32; k++)
+    {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static int gcd(int a, int b)
+{
+    while (b)
+    {
+        auto t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// banks are built once per (up, down) pair and shared by every resampler using that ratio.
+static const int16_t *polyphase_bank(int up, int down, int taps)
+{
+    static std::mutex mtx;
+    static std::map<std::pair<int, int>, std::vector<int16_t>> banks;
+
+    std::lock_guard<std::mutex> grd(mtx);
+    auto &bank = banks[{up, down}];
+    if (!bank.empty())
+    {
+        return bank.data();
+    }
+
+    bank.resize((size_t)up * taps);
+    auto cutoff = std::min(1.0, (double)up / down) * PPR_ROLLOFF;
+    auto half = taps / 2;
+    std::vector<double> coeffs(taps);
+    for (int p = 0; p < up; p++)
+    {
+        auto sum = 0.0;
+        for (int j = 0; j < taps; j++)
+        {
+            auto x = (double)(j - (half - 1)) - (double)p / up;
+            auto r = x / half;
+            auto win = std::fabs(r) < 1.0 ? bessel_i0(PPR_KAISER_BETA * std::sqrt(1.0 - r * r)) / bessel_i0(PPR_KAISER_BETA)
+                                          : 0.0;
+            coeffs[j] = cutoff * sinc(cutoff * x) * win;
+            sum += coeffs[j];
+        }
+
+        // unity dc gain per phase, rounding residue goes to the center tap.
+        auto *dst = &bank[(size_t)p * taps];
+        auto total = 0;
+        for (int j = 0; j < taps; j++)
+        {
+            dst[j] = clamp_s16((int32_t)std::lround(coeffs[j] / sum * 32768.0));
+            total += dst[j];
+        }
+        dst[half - 1] = clamp_s16(dst[half - 1] + 32768 - total);
+    }
+    return bank.data();
+}
+
+static inline int32_t dot_s16(const int16_t *x, const int16_t *h, int taps)
+{
+#if defined(AUDIO_MIX_X86) && defined(__SSE2__)
+    auto acc = _mm_setzero_si128();
+    for (int j = 0; j < taps; j += 8)
+    {
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(x + j)),
+                                                _mm_loadu_si128((const __m128i *)(h + j))));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+    return _mm_cvtsi128_si32(acc);
+#elif defined(AUDIO_MIX_NEON)
+    auto acc = vdupq_n_s32(0);
+    for (int j = 0; j < taps; j += 8)
+    {
+        auto a = vld1q_s16(x + j);
+        auto b = vld1q_s16(h + j);
+        acc = vmlal_s16(acc, vget_low_s16(a), vget_low_s16(b));
+        acc = vmlal_s16(acc, vget_high_s16(a), vget_high_s16(b));
+    }
+    auto pair = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+    return vget_lane_s32(vpadd_s32(pair, pair), 0);
+#else
+    int32_t acc = 0;
+    for (int j = 0; j < taps; j++)
+    {
+        acc += (int32_t)x[j] * h[j];
+    }
+    return acc;
+#endif
+}
+
+PolyphaseResampler::PolyphaseResampler(int fsi, int fso, int _chan, size_t max_input)
+    : max_chan(_chan), chan(_chan), max_in(max_input), hist_len(0), pos(0)
+{
+    auto g = gcd(fsi, fso);
+    up = fso / g;
+    down = fsi / g;
+    if (up > PPR_MAX_PHASES)
+    {
+        // irregular rates, approximate the ratio with a bounded number of phases.
+        down = (int)std::lround((double)down * PPR_MAX_PHASES / up);
+        up = PPR_MAX_PHASES;
+    }
+
+    auto ratio = std::min(1.0, (double)up / down);
+    taps = (int)std::ceil(2 * PPR_ZERO_CROSSINGS / ratio);
+    taps = (taps + 7) / 8 * 8;
+    bank = polyphase_bank(up, down, taps);
+
+    work = new int16_t[(size_t)chan * (taps + max_in)];
+    std::memset(work, 0, (size_t)chan * (taps + max_in) * sizeof(int16_t));
+    hist_len = taps - 1;
+}
+
+PolyphaseResampler::~PolyphaseResampler()
+{
+    delete[] work;
+}
+
+size_t PolyphaseResampler::process(const int16_t *input, size_t frames, int16_t *output)
+{
+    size_t out_frames = 0;
+    auto stride = taps + max_in;
+    while (frames > 0)
+    {
+        auto n = std::min(frames, max_in);
+        for (int c = 0; c < chan; c++)
+        {
+            auto *dst = work + c * stride + hist_len;
+            for (size_t k = 0; k < n; k++)
+            {
+                dst[k] = input[k * chan + c];
+            }
+        }
+
+        auto avail = hist_len + n;
+        while (pos / up + taps <= avail)
+        {
+            auto i = (size_t)(pos / up);
+            auto *coeffs = bank + (size_t)(pos % up) * taps;
+            for (int c = 0; c < chan; c++)
+            {
+                auto acc = dot_s16(work + c * stride + i, coeffs, taps);
+                *output++ = clamp_s16((acc + (1 << 14)) >> 15);
+            }
+            out_frames++;
+            pos += down;
+        }
+
+        // keep the unconsumed tail as history for the next period.
+        auto consumed = std::min((size_t)(pos / up), avail);
+        for (int c = 0; c < chan; c++)
+        {
+            std::memmove(work + c * stride, work + c * stride + consumed, (avail - consumed) * sizeof(int16_t));
+        }
+        hist_len = avail - consumed;
+        pos -= (uint64_t)consumed * up;
+        input += n * chan;
+        frames -= n;
+    }
+    return out_frames;
+}
+
+size_t PolyphaseResampler::max_output(size_t frames) const
+{
+    return (frames * up + down - 1) / down + 1;
+}
+
+void PolyphaseResampler::reset(int _chan)
+{
+    // buffers are sized for the channel count given at construction, fewer channels reuse them.
+    chan = std::min(_chan, max_chan);
+    std::memset(work, 0, (size_t)max_chan * (taps + max_in) * sizeof(int16_t));
+    hist_len = taps - 1;
+    pos = 0;
+}
+
+static constexpr auto VSR_PHASE_BITS = 8;
+static constexpr auto VSR_TAPS = 32;
+static constexpr auto VSR_MAX_DEVIATION = 0.01;
+
+static inline uint64_t varispeed_step(double ratio)
+{
+    ratio = std::min(std::max(ratio, 1.0 - VSR_MAX_DEVIATION), 1.0 + VSR_MAX_DEVIATION);
+    return (uint64_t)std::llround(ratio * 4294967296.0);
+}
+
+// position is Q32 in input frames, rounded to the nearest of 2^VSR_PHASE_BITS phases.
+static inline uint64_t varispeed_round(uint64_t pos)
+{
+    return pos + (1ULL << (31 - VSR_PHASE_BITS));
+}
+
+VarispeedResampler::VarispeedResampler(int _chan, size_t max_output)
+    : max_chan(_chan), chan(_chan), max_in((size_t)std::ceil(max_output * (1.0 + VSR_MAX_DEVIATION)) + 2),
+      taps(VSR_TAPS), hist_len(VSR_TAPS - 1), pos(0)
+{
+    bank = polyphase_bank(1 << VSR_PHASE_BITS, 1 << VSR_PHASE_BITS, taps);
+    work = new int16_t[(size_t)chan * (taps + max_in)];
+    std::memset(work, 0, (size_t)chan * (taps + max_in) * sizeof(int16_t));
+}
+
+VarispeedResampler::~VarispeedResampler()
+{
+    delete[] work;
+}
+
+size_t VarispeedResampler::required(size_t out_frames, double ratio) const
+{
+    if (out_frames == 0)
+    {
+        return 0;
+    }
+
+    auto last = varispeed_round(pos + (out_frames - 1) * varispeed_step(ratio)) >> 32;
+    auto avail = (size_t)last + taps;
+    return avail > hist_len ? std::min(avail - hist_len, max_in) : 0;
+}
+
+void VarispeedResampler::process(const int16_t *input, size_t in_frames, int16_t *output, size_t out_frames,
+                                 double ratio)
+{
+    auto stride = taps + max_in;
+    in_frames = std::min(in_frames, max_in);
+    for (int c = 0; c < chan; c++)
+    {
+        auto *dst = work + c * stride + hist_len;
+        for (size_t k = 0; k < in_frames; k++)
+        {
+            dst[k] = input[k * chan + c];
+        }
+    }
+
+    auto step = varispeed_step(ratio);
+    auto avail = hist_len + in_frames;
+    for (size_t k = 0; k < out_frames; k++)
+    {
+        auto q = varispeed_round(pos);
+        auto i = (size_t)(q >> 32);
+        if (i + taps > avail)
+        {
+            std::memset(output, 0, (out_frames - k) * chan * sizeof(int16_t));
+            break;
+        }
+
+        auto *coeffs = bank + (size_t)((q & 0xffffffff) >> (32 - VSR_PHASE_BITS)) * taps;
+        for (int c = 0; c < chan; c++)
+        {
+            auto acc = dot_s16(work + c * stride + i, coeffs, taps);
+            *output++ = clamp_s16((acc + (1 << 14)) >> 15);
+        }
+        pos += step;
+    }
+
+    auto consumed = std::min((size_t)(pos >> 32), avail);
+    for (int c = 0; c < chan; c++)
+    {
+        std::memmove(work + c * stride, work + c * stride + consumed, (avail - consumed) * sizeof(int16_t));
+    }
+    hist_len = avail - consumed;
+    pos -= (uint64_t)consumed << 32;
+}
+
+void VarispeedResampler::reset(int _chan)
+{
+    chan = std::min(_chan, max_chan);
+    std::memset(work, 0, (size_t)max_chan * (taps + max_in) * sizeof(int16_t));
+    hist_len = taps - 1;
+    pos = 0;
+}
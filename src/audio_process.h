@@ -1,13 +1,66 @@
 #ifndef AUDIO_PROCESS_HEADER
 #define AUDIO_PROCESS_HEADER
 #include <cinttypes>
+#include <cstddef>
 
 void mix_channels(const int16_t *ssrc, int out_chan, int ssrc_chan, int frames_num, int16_t *output);
 
+const char *mix_channels_kernel();
+
+double mean_square(const int16_t *pcm, size_t samples);
+
 void decimator_2(const int16_t *src, size_t len, int16_t *dst, int32_t *filtState);
 
 void decimator_3(const int16_t *src, size_t len, int16_t *dst, int32_t *filtState, double *buffer);
 
+class PolyphaseResampler
+{
+public:
+    PolyphaseResampler(int fsi, int fso, int chan, size_t max_input);
+    ~PolyphaseResampler();
+
+    size_t process(const int16_t *input, size_t frames, int16_t *output);
+
+    size_t max_output(size_t frames) const;
+
+    void reset(int _chan);
+
+private:
+    const int max_chan;
+    int chan;
+    const size_t max_in;
+    int up;
+    int down;
+    int taps;
+    const int16_t *bank;
+    int16_t *work;
+    size_t hist_len;
+    uint64_t pos;
+};
+
+class VarispeedResampler
+{
+public:
+    VarispeedResampler(int chan, size_t max_output);
+    ~VarispeedResampler();
+
+    size_t required(size_t out_frames, double ratio) const;
+
+    void process(const int16_t *input, size_t in_frames, int16_t *output, size_t out_frames, double ratio);
+
+    void reset(int _chan);
+
+private:
+    const int max_chan;
+    int chan;
+    const size_t max_in;
+    int taps;
+    const int16_t *bank;
+    int16_t *work;
+    size_t hist_len;
+    uint64_t pos;
+};
+
 class SincInterpolator
 {
 public:
@@ -3,28 +3,96 @@
 #include "audio_interface.h"
 #include "audio_process.h"
 #include "audio_network.h"
+#include <algorithm>
 
 using udp = asio::ip::udp;
 #define SERVICE (AudioService::GetService().executor())
 
-#ifdef __linux__
-static constexpr auto OS_CLK_OFFSET = 50;
-#else
-static constexpr auto OS_CLK_OFFSET = 500;
-#endif
+static constexpr auto MEDIA_CLOCK_CATCHUP_PERIODS = 8;
+static constexpr auto SPEAKER_HOLD_GAIN = 2.0f;
+static constexpr auto SPEAKER_PROBE_INTERVAL = 8;
+static constexpr auto SESSION_IDLE_TIMEOUT = std::chrono::seconds(30);
+static constexpr auto SESSION_SWEEP_INTERVAL = std::chrono::seconds(1);
+static constexpr auto SESSION_LIMIT = 256;
+static constexpr auto SESSION_POOL_SIZE = 16;
+static constexpr auto SESSION_MAX_CHANNEL = 2;
 static constexpr auto PHSY_DEVICE_RESRT_INTERVAL = std::chrono::minutes(30);
 static constexpr auto PCM_CUSTOM_PERIOD_SIZE = 480;
 static constexpr auto PCM_CUSTOM_SAMPLE_INRV = PCM_CUSTOM_PERIOD_SIZE * 1000 * 1000 / 48000;
+static constexpr auto PCM_RECV_BUFFER_SIZE = 6 * PCM_CUSTOM_PERIOD_SIZE;
+static constexpr auto HANDOFF_MAX_FRAMES = 2 * 48000 * 40 / 1000;
+static constexpr auto HANDOFF_QUEUE_DEPTH = 8;
+static constexpr auto HANDOFF_RECORD_HEAD = 2;
+#ifdef AUDIO_BATCH_IO
+static constexpr auto PCM_RECV_BATCH_SIZE = AUDIO_BATCH_SIZE;
+#else
+static constexpr auto PCM_RECV_BATCH_SIZE = 1;
+#endif
+static constexpr auto PCM_RECV_SHARD_LIMIT = 64;
+static constexpr auto SESSION_EXTENDED_TAG = 1ULL << 32;
 
 inline constexpr uint16_t token2port(unsigned char token)
 {
     return (uint16_t)(0xccu << 8) + (uint16_t)token;
 }
 
-void start_audio_service()
+// source ids are tagged above the 32-bit range, so that they never collide with legacy tokens.
+inline uint64_t session_key(const char *data)
+{
+    auto source = PacketHeader::source(data);
+    return PacketHeader::extended(data) ? SESSION_EXTENDED_TAG | source : source;
+}
+
+MediaClock::MediaClock() : fs(1), ps(0), periods(0), late_wakeups(0)
+{
+}
+
+void MediaClock::reset(int _fs, int _ps, time_point now)
+{
+    fs = _fs > 0 ? _fs : 1;
+    ps = _ps;
+    origin = now;
+    periods = 0;
+}
+
+int MediaClock::advance(time_point now)
+{
+    int due = 0;
+    while (due < MEDIA_CLOCK_CATCHUP_PERIODS && deadline() <= now)
+    {
+        periods++;
+        due++;
+    }
+
+    if (due > 1)
+    {
+        late_wakeups++;
+    }
+
+    if (deadline() <= now)
+    {
+        // too far behind to catch up without a burst, continue one period from now.
+        AUDIO_INFO_PRINT("media clock stalled for %lld us, %llu late wake-ups so far\n",
+                         (long long)std::chrono::duration_cast<std::chrono::microseconds>(now - deadline()).count(),
+                         (unsigned long long)late_wakeups);
+        origin = now;
+        periods = 1;
+    }
+    return due;
+}
+
+MediaClock::time_point MediaClock::deadline() const
 {
-    AudioService::GetService().start();
-    AUDIO_INFO_PRINT("compiled at %s %s\n", __DATE__, __TIME__);
+    // split into whole seconds so that the product can't overflow over long runs.
+    auto frames = periods * (uint64_t)ps;
+    auto ns = frames / fs * 1000000000ULL + frames % fs * 1000000000ULL / fs;
+    return origin + std::chrono::nanoseconds(ns);
+}
+
+void start_audio_service(const AudioServiceConfig &config)
+{
+    AudioService::GetService().start(config);
+    AUDIO_INFO_PRINT("compiled at %s %s, mixer kernel: %s\n", __DATE__, __TIME__, mix_channels_kernel());
 }
 
 void stop_audio_service()
@@ -56,6 +124,16 @@ void OAStream::unmute(unsigned char _token)
     impl->unmute(_token);
 }
 
+void OAStream::mute_source(uint32_t source_id)
+{
+    impl->mute_source(source_id);
+}
+
+void OAStream::unmute_source(uint32_t source_id)
+{
+    impl->unmute_source(source_id);
+}
+
 void OAStream::stop()
 {
     impl->stop();
@@ -67,34 +145,64 @@ void OAStream::direct_push_pcm(uint8_t input_token, uint8_t input_chan, int inpu
     impl->direct_push_pcm(input_token, input_chan, input_period, sample_rate, data);
 }
 
+void OAStream::set_active_speakers(int n)
+{
+    impl->set_active_speakers(n);
+}
+
+void OAStream::set_session_policy(int idle_timeout_ms, int max_sessions, int pool_size)
+{
+    impl->set_session_policy(idle_timeout_ms, max_sessions, pool_size);
+}
+
+void OAStream::use_shared_port(uint32_t stream_id)
+{
+    impl->use_shared_port(stream_id);
+}
+
+void OAStream::set_receive_shards(int shards, bool steer_by_sender)
+{
+    impl->set_receive_shards(shards, steer_by_sender);
+}
+
+void OAStream::set_deep_redundancy(bool enable)
+{
+    impl->set_deep_redundancy(enable);
+}
+
 OAStreamImpl::OAStreamImpl(unsigned char _token, AudioBandWidth _bandwidth, AudioPeriodSize _period,
                            const std::string &_hw_name, bool _enable_network)
-    : token(_token), enable_network(_enable_network), fs(enum2val(_bandwidth)), ps(enum2val(_period)), chan_num(0),
-      max_chan(0), recv_buf(nullptr), oas_ready(false), timer(SERVICE)
+    : token(_token), enable_network(_enable_network), shared_port(false), shared_id(0), fs(enum2val(_bandwidth)),
+      ps(enum2val(_period)), chan_num(0), max_chan(0), active_speakers(0), mix_snapshot(new MixSnapshot), mix_hazard(nullptr),
+      idle_timeout(SESSION_IDLE_TIMEOUT), max_sessions(SESSION_LIMIT),
+      session_pool_size(SESSION_POOL_SIZE), session_full(false), sweep_timer(SERVICE),
+      recv_shards(1), recv_steering(false), deep_redundancy(false), recv_buf(nullptr), oas_ready(false)
 {
     if (_hw_name.find(".pcm") != std::string::npos)
     {
-        odevice = std::make_unique<WaveOADevice>(SERVICE);
+        odevice = std::make_unique<WaveOADevice>(BULK_SERVICE);
     }
     else if (_hw_name.find(".multi") != std::string::npos)
     {
         odevice = std::make_unique<MultiOADevice>(3, 11, 16);
     }
+    else if (NullOADevice::match(_hw_name))
+    {
+        odevice = std::make_unique<NullOADevice>();
+    }
     else
     {
         odevice = std::make_unique<PhsyOADevice>();
     }
 
-    if (odevice->create(_hw_name, this, fs, ps, chan_num, max_chan))
-    {
-        // choose a bit large buffer size.
-        recv_buf = new char[6 * PCM_CUSTOM_PERIOD_SIZE];
-    }
+    odevice->create(_hw_name, this, fs, ps, chan_num, max_chan);
+    timer = std::make_unique<asio::steady_timer>(odevice->blocking_task() ? BULK_SERVICE : SERVICE);
 }
 
 OAStreamImpl::~OAStreamImpl()
 {
     stop();
+    delete mix_snapshot.load();
     delete[] recv_buf;
 }
 
@@ -112,27 +220,63 @@ bool OAStreamImpl::start()
 
     oas_ready = true;
 
-    if (enable_network)
+    if (enable_network && shared_port)
     {
-        try
+        if (!AudioService::GetService().attach_stream(shared_id, shared_from_this()))
         {
-            sock = std::make_unique<udp::socket>(SERVICE, udp::endpoint(udp::v4(), token2port(token)));
+            return false;
         }
-        catch (const std::exception &e)
+    }
+    else if (enable_network)
+    {
+        if (!recv_buf)
         {
-            AUDIO_ERROR_PRINT("%s\n", e.what());
-            return false;
+            // choose a bit large buffer size, every shard receives into its own region.
+            recv_buf = new char[recv_shards * PCM_RECV_BATCH_SIZE * PCM_RECV_BUFFER_SIZE];
+            recv_armed.reset(new std::atomic_bool[recv_shards]());
+        }
+
+        // sockets are opened once and only cancelled by stop(), a receive chain still draining may use them.
+        if (socks.empty())
+        {
+#ifdef AUDIO_REUSEPORT
+            if (!open_port_shards(SERVICE, token2port(token), recv_shards, recv_steering, socks))
+            {
+                return false;
+            }
+#else
+            try
+            {
+                socks.push_back(std::make_unique<udp::socket>(SERVICE, udp::endpoint(udp::v4(), token2port(token))));
+            }
+            catch (const std::exception &e)
+            {
+                AUDIO_ERROR_PRINT("%s\n", e.what());
+                return false;
+            }
+#endif
         }
 
-        asio::post(SERVICE, [self = shared_from_this()]()
-                   { self->do_receive(); });
+        for (size_t i = 0; i < socks.size(); i++)
+        {
+            // a chain that survived the last stop keeps its shard, no second receive is armed next to it.
+            if (!recv_armed[i].exchange(true))
+            {
+                asio::post(SERVICE, [self = shared_from_this(), i]()
+                           { self->do_receive(i); });
+            }
+        }
     }
 
     if (odevice->enable_external_loop())
     {
+        clock.reset(fs, ps, std::chrono::steady_clock::now());
         exec_external_loop();
     }
 
+    fill_session_pool();
+    exec_session_sweep();
+
     AUDIO_INFO_PRINT("start oastream\n");
     return true;
 }
@@ -140,40 +284,46 @@ bool OAStreamImpl::start()
 void OAStreamImpl::mute(unsigned char _token)
 {
     std::lock_guard<std::mutex> grd(recv_mtx);
-    for (auto &s : net_sessions)
+    if (auto s = net_sessions.find(_token))
     {
-        if (s.first == _token)
-        {
-            s.second->enable = false;
-        }
+        s->buffer->enable = false;
     }
 
-    for (auto &s : loc_sessions)
+    if (auto s = loc_sessions.find(_token))
     {
-        if (s.first == _token)
-        {
-            s.second->enable = false;
-        }
+        s->buffer->enable = false;
     }
 }
 
 void OAStreamImpl::unmute(unsigned char _token)
 {
     std::lock_guard<std::mutex> grd(recv_mtx);
-    for (auto &s : net_sessions)
+    if (auto s = net_sessions.find(_token))
     {
-        if (s.first == _token)
-        {
-            s.second->enable = true;
-        }
+        s->buffer->enable = true;
     }
 
-    for (auto &s : loc_sessions)
+    if (auto s = loc_sessions.find(_token))
     {
-        if (s.first == _token)
-        {
-            s.second->enable = true;
-        }
+        s->buffer->enable = true;
+    }
+}
+
+void OAStreamImpl::mute_source(uint32_t source_id)
+{
+    std::lock_guard<std::mutex> grd(recv_mtx);
+    if (auto s = net_sessions.find(SESSION_EXTENDED_TAG | source_id))
+    {
+        s->buffer->enable = false;
+    }
+}
+
+void OAStreamImpl::unmute_source(uint32_t source_id)
+{
+    std::lock_guard<std::mutex> grd(recv_mtx);
+    if (auto s = net_sessions.find(SESSION_EXTENDED_TAG | source_id))
+    {
+        s->buffer->enable = true;
     }
 }
 
@@ -187,6 +337,18 @@ void OAStreamImpl::stop()
     if (odevice->stop())
     {
         oas_ready = false;
+        // a restart arms its own sweep, a pending one would run alongside it.
+        sweep_timer.cancel();
+        for (auto &sock : socks)
+        {
+            asio::error_code ec;
+            sock->cancel(ec);
+        }
+    }
+
+    if (enable_network && shared_port)
+    {
+        AudioService::GetService().detach_stream(shared_id);
     }
     AUDIO_INFO_PRINT("stop oastream\n");
 }
@@ -195,23 +357,29 @@ void OAStreamImpl::write_pcm_frames(int16_t *output, int frame_number)
 {
     std::memset(output, 0, chan_num * frame_number * sizeof(int16_t));
     {
-        std::lock_guard<std::mutex> grd(recv_mtx);
-        for (const auto &s : net_sessions)
+        auto snapshot = acquire_snapshot();
+        select_speakers(snapshot, active_speakers.load(std::memory_order_relaxed));
+        for (auto s : snapshot->net)
         {
-            s.second->load_data(ps * s.second->chan * sizeof(int16_t));
-            if (s.second->enable)
+            if (!s->enable || !s->selected)
             {
-                mix_channels((const int16_t *)s.second->out_buf, chan_num, s.second->chan, ps, (int16_t *)output);
+                s->skip_data();
+                continue;
             }
+            s->load_data(ps * s->chan * sizeof(int16_t));
+            mix_channels((const int16_t *)s->out_buf, chan_num, s->chan, ps, (int16_t *)output);
         }
-        for (const auto &s : loc_sessions)
+        for (auto s : snapshot->loc)
         {
-            s.second->load_data(ps * s.second->chan * sizeof(int16_t));
-            if (s.second->enable)
+            if (!s->enable || !s->selected)
             {
-                mix_channels((const int16_t *)s.second->out_buf, chan_num, s.second->chan, ps, (int16_t *)output);
+                s->skip_data();
+                continue;
             }
+            s->load_data(ps * s->chan * sizeof(int16_t));
+            mix_channels((const int16_t *)s->out_buf, chan_num, s->chan, ps, (int16_t *)output);
         }
+        release_snapshot();
     }
 
     {
@@ -229,13 +397,16 @@ void OAStreamImpl::exec_external_loop()
     {
         return;
     }
-    auto interval = ceil_div(ps * 1000, fs);
-    if (!odevice->async_task(interval))
+    auto due = clock.advance(std::chrono::steady_clock::now());
+    for (int i = 0; i < due; i++)
     {
-        return;
+        if (!odevice->async_task(ps))
+        {
+            return;
+        }
     }
-    timer.expires_after(asio::chrono::microseconds(interval - OS_CLK_OFFSET));
-    timer.async_wait([self = shared_from_this()](const asio::error_code &ec)
+    timer->expires_at(clock.deadline());
+    timer->async_wait([self = shared_from_this()](const asio::error_code &ec)
                      {
         if (ec)
         {
@@ -244,219 +415,705 @@ void OAStreamImpl::exec_external_loop()
         self->exec_external_loop(); });
 }
 
-void OAStreamImpl::do_receive()
+void OAStreamImpl::do_receive(size_t shard)
 {
     if (!oas_ready)
     {
-        return;
+        // the chain ends here, unless start() ran in between and found the shard still armed.
+        recv_armed[shard] = false;
+        if (!oas_ready || recv_armed[shard].exchange(true))
+        {
+            return;
+        }
     }
+    // each shard has a single outstanding receive, so shards run in parallel but never against themselves.
+    // cancelled receives come back here as well, they end or continue the chain like any other completion.
+    auto buf = recv_buf + shard * PCM_RECV_BATCH_SIZE * PCM_RECV_BUFFER_SIZE;
+#ifdef AUDIO_BATCH_IO
+    socks[shard]->async_wait(udp::socket::wait_read,
+                             [self = shared_from_this(), shard, buf](std::error_code ec)
+                             {
+                                 if (!ec)
+                                 {
+                                     size_t lens[PCM_RECV_BATCH_SIZE];
+                                     int count = 0;
+                                     do
+                                     {
+                                         count = batch_receive(self->socks[shard]->native_handle(), buf,
+                                                               PCM_RECV_BUFFER_SIZE, lens, PCM_RECV_BATCH_SIZE);
+                                         for (int i = 0; i < count; i++)
+                                         {
+                                             self->handle_packet(buf + i * PCM_RECV_BUFFER_SIZE, lens[i]);
+                                         }
+                                     } while (count == PCM_RECV_BATCH_SIZE);
+                                 }
+                                 self->do_receive(shard);
+                             });
+#else
     static udp::endpoint sender_endpoint;
-    sock->async_receive_from(
-        asio::buffer(recv_buf, PCM_CUSTOM_PERIOD_SIZE * 6), sender_endpoint,
-        [self = shared_from_this()](std::error_code ec, std::size_t bytes)
+    socks[shard]->async_receive_from(
+        asio::buffer(buf, PCM_RECV_BUFFER_SIZE), sender_endpoint,
+        [self = shared_from_this(), shard, buf](std::error_code ec, std::size_t bytes)
         {
-            if (!ec && PacketHeader::validate(self->recv_buf, bytes))
+            if (!ec)
             {
-                auto sender = self->recv_buf[0];
-                auto chan = self->recv_buf[1];
-                std::lock_guard<std::mutex> grd(self->recv_mtx);
-                if (self->net_sessions.find(sender) == self->net_sessions.end())
-                {
-                    // auto session = std::make_unique<SessionData>(self->ps * chan * sizeof(int16_t), 6, chan);
-                    self->decoders.insert({sender, std::make_unique<NetDecoder>(sender, chan, self->fs)});
-                    self->net_sessions.insert(
-                        {sender, std::make_unique<SessionData>(self->ps * chan * sizeof(int16_t), 6, chan)});
-                    AUDIO_INFO_PRINT("new connection: %u\n", sender);
-                }
-                const char *decode_data = nullptr;
-                size_t decode_length = 0;
-                if (self->decoders.at(sender)->commit(self->recv_buf, bytes, decode_data, decode_length))
-                {
-                    self->net_sessions.at(sender)->store_data(decode_data, decode_length);
-                }
+                self->handle_packet(buf, bytes);
             }
-            self->do_receive();
+            self->do_receive(shard);
         });
+#endif
 }
 
-void OAStreamImpl::direct_push_pcm(uint8_t input_token, uint8_t input_chan, int input_period, int sample_rate,
-                                   const int16_t *data)
+void OAStreamImpl::handle_packet(const char *data, size_t bytes)
 {
-    std::lock_guard<std::mutex> grd(recv_mtx);
-    if (loc_sessions.find(input_token) == loc_sessions.end())
+    if (!PacketHeader::validate(data, bytes))
     {
-        loc_sessions.insert(
-            {input_token, std::make_unique<SessionData>(ps * input_chan * sizeof(int16_t), 3, input_chan)});
-        samplers.insert({input_token, std::make_unique<LocEncoder>(sample_rate, fs, input_chan)});
-        AUDIO_INFO_PRINT("new connection: %u\n", input_token);
+        return;
     }
-    int16_t *decode_data = nullptr;
-    size_t decode_frame = 0;
-    if (samplers.at(input_token)
-            ->commit((int16_t *)data, input_period, decode_data, decode_frame))
+
+    auto sender = session_key(data);
+    auto chan = PacketHeader::channels(data);
+    NetDecoder *decoder = nullptr;
+    JitterBuffer *session = nullptr;
     {
-        loc_sessions.at(input_token)->store_data((const char *)decode_data, decode_frame * input_chan * sizeof(int16_t));
+        // the lock only guards the registry, decoding runs outside of it.
+        std::lock_guard<std::mutex> grd(recv_mtx);
+        auto now = media_now();
+        auto slot = net_sessions.find(sender);
+        if (!slot)
+        {
+            if (!admit_session(now))
+            {
+                return;
+            }
+            slot = open_net_session(sender, chan);
+            if (!slot)
+            {
+                return;
+            }
+            publish_snapshot();
+            AUDIO_INFO_PRINT("new connection: %u\n", (uint32_t)sender);
+        }
+        slot->last_active = now;
+        decoder = slot->decoder.get();
+        session = slot->buffer.get();
     }
-}
 
-void OAStreamImpl::set_callback(std::function<void(const int16_t *, int)> &&fn)
-{
-    std::lock_guard<std::mutex> grd(delv_mtx);
-    delv_cb = fn;
-}
+    auto seq = PacketHeader::get_sequence(data, decoder->sequence());
+    auto probing = !session->enable || !session->selected;
+    if (probing && seq % SPEAKER_PROBE_INTERVAL > 1)
+    {
+        // unheard sessions only decode often enough to keep their level up to date, two packets per
+        // interval so that the one after the decoder reset only warms it up.
+        decoder->skip(data, bytes);
+        return;
+    }
 
-// IAStream
-IAStream::IAStream(unsigned char _token, const std::string &_hw_name, AudioBandWidth _bandwidth,
-                   AudioPeriodSize _period, bool _enable_network, bool _enable_reset)
-{
-    if (_bandwidth == AudioBandWidth::Unknown)
+    const char *decode_data = nullptr;
+    size_t decode_length = 0;
+    uint32_t lost_seq = 0;
+    auto oldest = session->playable_since(seq);
+    while (decoder->recover(data, bytes, oldest, lost_seq, decode_data, decode_length))
     {
-        AUDIO_ERROR_PRINT("Sample rate unknown is not allowed for input stream.\n");
-        _bandwidth = AudioBandWidth::Full;
+        // a lost packet arriving late still replaces its concealment in the jitter buffer.
+        session->store_data(lost_seq, decode_data, decode_length);
     }
-    impl = std::make_shared<IAStreamImpl>(_token, _bandwidth, _period, _hw_name, _enable_network, _enable_reset);
-}
 
-IAStream::IAStream(unsigned char _token, const OAStream &oas, bool _enable_network, bool _enable_auto_reset)
-{
-    impl = std::make_shared<IAStreamImpl>(_token, oas.impl, _enable_network, _enable_auto_reset);
+    if (decoder->commit(data, bytes, decode_data, decode_length))
+    {
+        // a probe stands for the whole interval, so the level releases as fast as for a heard session.
+        auto level_periods = decoder->restarted() ? 0 : (probing ? SPEAKER_PROBE_INTERVAL : 1);
+        session->update_jitter(decoder->current_jitter());
+        session->store_data(decoder->sequence(), decode_data, decode_length, level_periods);
+    }
 }
 
-IAStream::~IAStream() = default;
-
-bool IAStream::start()
+void OAStreamImpl::direct_push_pcm(uint8_t input_token, uint8_t input_chan, int input_period, int sample_rate,
+                                   const int16_t *data)
 {
-    return impl->start();
-}
+    LocEncoder *sampler = nullptr;
+    SessionData *session = nullptr;
+    {
+        std::lock_guard<std::mutex> grd(recv_mtx);
+        auto now = media_now();
+        auto slot = loc_sessions.find(input_token);
+        if (!slot)
+        {
+            if (!admit_session(now))
+            {
+                return;
+            }
+            slot = open_loc_session(input_token, input_chan, sample_rate);
+            if (!slot)
+            {
+                return;
+            }
+            publish_snapshot();
+            AUDIO_INFO_PRINT("new connection: %u\n", input_token);
+        }
+        slot->last_active = now;
+        sampler = slot->sampler.get();
+        session = slot->buffer.get();
+    }
 
-void IAStream::mute()
-{
-    impl->mute();
+    int16_t *decode_data = nullptr;
+    size_t decode_frame = 0;
+    if (sampler->commit((int16_t *)data, input_period, decode_data, decode_frame))
+    {
+        session->store_data((const char *)decode_data, decode_frame * input_chan * sizeof(int16_t));
+    }
 }
 
-void IAStream::unmute()
+void OAStreamImpl::publish_snapshot()
 {
-    impl->unmute();
+    // called with recv_mtx held, the mixer never blocks on it and only ever sees complete snapshots.
+    auto next = new MixSnapshot;
+    for (auto id : net_sessions.ids())
+    {
+        next->net.push_back(net_sessions.find(id)->buffer.get());
+    }
+    for (auto id : loc_sessions.ids())
+    {
+        next->loc.push_back(loc_sessions.find(id)->buffer.get());
+    }
+    next->rank.reserve(next->net.size() + next->loc.size());
+    mix_retired.emplace_back(mix_snapshot.exchange(next));
+    reclaim_snapshots();
 }
 
-void IAStream::stop()
+void OAStreamImpl::reclaim_snapshots()
 {
-    impl->stop();
+    auto in_use = mix_hazard.load();
+    mix_retired.erase(std::remove_if(mix_retired.begin(), mix_retired.end(),
+                                     [in_use](const std::unique_ptr<MixSnapshot> &s) { return s.get() != in_use; }),
+                      mix_retired.end());
 }
 
-void IAStream::connect(const OAStream &sink)
+MixSnapshot *OAStreamImpl::acquire_snapshot()
 {
-    impl->connect(sink.impl);
+    // single reader hazard pointer, retries only if a writer publishes in between.
+    MixSnapshot *snapshot = nullptr;
+    do
+    {
+        snapshot = mix_snapshot.load();
+        mix_hazard.store(snapshot);
+    } while (snapshot != mix_snapshot.load());
+    return snapshot;
 }
 
-bool IAStream::connect(const std::string &ip, unsigned char token)
+void OAStreamImpl::release_snapshot()
 {
-    return impl->connect(ip, token2port(token));
+    mix_hazard.store(nullptr, std::memory_order_release);
 }
 
-void IAStream::set_callback(AudioInputCallBack _cb, int _ps, void *_user_data)
+void OAStreamImpl::select_speakers(MixSnapshot *snapshot, int n)
 {
-    impl->set_callback(_cb, _ps, _user_data);
-}
+    auto total = snapshot->net.size() + snapshot->loc.size();
+    if (n <= 0 || (size_t)n >= total)
+    {
+        for (auto s : snapshot->net)
+        {
+            s->selected = true;
+        }
+        for (auto s : snapshot->loc)
+        {
+            s->selected = true;
+        }
+        return;
+    }
 
-IAStreamImpl::IAStreamImpl(unsigned char _token, AudioBandWidth _bandwidth, AudioPeriodSize _period,
-                           const std::string &_hw_name, bool _enable_network, bool _enable_reset)
-    : token(_token), enable_network(_enable_network), hw_name(_hw_name), fs(enum2val(_bandwidth)),
-      ps(fs / 1000 * (enum2val(_period))), chan_num(0), max_chan(0), muted(false), timer0(SERVICE),
-      timer1(SERVICE), usr_cb(nullptr), usr_data(nullptr), ias_ready(false)
-{
-    if (_hw_name.find(".wav") != std::string::npos)
+    // current speakers get a bonus so that two voices of similar level don't flip every period.
+    auto score = [](float level, bool selected, bool enable)
+    { return enable ? (selected ? level * SPEAKER_HOLD_GAIN : level) : -1.0f; };
+    auto &rank = snapshot->rank;
+    rank.clear();
+    for (size_t i = 0; i < snapshot->net.size(); i++)
     {
-        idevice = std::make_unique<WaveIADevice>(SERVICE);
+        auto s = snapshot->net[i];
+        rank.emplace_back(score(s->level.load(std::memory_order_relaxed), s->selected, s->enable), i);
     }
-    else if (_hw_name.find(".multi") != std::string::npos)
+    for (size_t i = 0; i < snapshot->loc.size(); i++)
     {
-        idevice = std::make_unique<MultiIADevice>(0, 8, 16);
+        auto s = snapshot->loc[i];
+        rank.emplace_back(score(s->level.load(std::memory_order_relaxed), s->selected, s->enable),
+                          snapshot->net.size() + i);
     }
-    else
+    std::nth_element(rank.begin(), rank.begin() + n, rank.end(),
+                     [](const std::pair<float, size_t> &a, const std::pair<float, size_t> &b)
+                     { return a.first > b.first; });
+
+    for (size_t k = 0; k < total; k++)
     {
-        idevice = std::make_unique<PhsyIADevice>();
+        auto idx = rank[k].second;
+        auto selected = k < (size_t)n && rank[k].first >= 0;
+        if (idx < snapshot->net.size())
+        {
+            snapshot->net[idx]->selected = selected;
+        }
+        else
+        {
+            snapshot->loc[idx - snapshot->net.size()]->selected = selected;
+        }
     }
+}
 
-    if (idevice->create(_hw_name, this, fs, ps, chan_num, max_chan))
+bool OAStreamImpl::admit_session(std::chrono::steady_clock::time_point now)
+{
+    if (net_sessions.size() + loc_sessions.size() >= max_sessions && evict_idle_sessions(now) == 0 &&
+        net_sessions.size() + loc_sessions.size() >= max_sessions)
     {
-        // session for raw data
-        session = std::make_unique<SessionData>(PCM_CUSTOM_PERIOD_SIZE * max_chan * sizeof(int16_t), 2, max_chan);
+        if (!session_full)
+        {
+            AUDIO_ERROR_PRINT("oastream :%u session limit %zu reached\n", token, max_sessions);
+            session_full = true;
+        }
+        return false;
     }
+    session_full = false;
+    return true;
+}
 
-    if (enable_network)
+NetSession *OAStreamImpl::open_net_session(uint64_t sender, uint8_t chan)
+{
+    auto slot = net_sessions.insert(sender);
+    if (!slot)
     {
-        encoder = std::make_unique<NetEncoder>(token, chan_num, ps, _bandwidth);
+        return nullptr;
     }
 
-    if (_enable_reset)
+    if (!session_pool.net.empty())
     {
-        reset_phsy_device();
+        *slot = std::move(session_pool.net.back());
+        session_pool.net.pop_back();
     }
+    else
+    {
+        // the pool ran dry, allocate a slot wide enough to be recycled for any sender.
+        slot->decoder = std::make_unique<NetDecoder>((uint32_t)sender, SESSION_MAX_CHANNEL, fs, deep_redundancy);
+        slot->buffer = std::make_unique<JitterBuffer>(fs, ps, SESSION_MAX_CHANNEL);
+    }
+    slot->decoder->reset((uint32_t)sender, chan);
+    slot->buffer->reset(chan);
+    return slot;
 }
 
-IAStreamImpl::IAStreamImpl(unsigned char _token, const std::shared_ptr<OAStreamImpl> &oas, bool _enable_network, bool _enable_reset)
-    : token(_token), enable_network(_enable_network), hw_name(""), fs(enum2val(AudioBandWidth::Full)),
-      ps(fs / 1000 * (enum2val(AudioPeriodSize::INR_10MS))), chan_num(0), max_chan(0), muted(false), timer0(SERVICE),
-      timer1(SERVICE), usr_cb(nullptr), usr_data(nullptr), ias_ready(false)
+LocSession *OAStreamImpl::open_loc_session(uint8_t input_token, uint8_t input_chan, int sample_rate)
 {
-    idevice = std::make_unique<PipeIADevice>(oas);
-    if (idevice->create(hw_name, this, fs, ps, chan_num, max_chan))
+    auto slot = loc_sessions.insert(input_token);
+    if (!slot)
     {
-        // session for raw data
-        session = std::make_unique<SessionData>(PCM_CUSTOM_PERIOD_SIZE * max_chan * sizeof(int16_t), 2, max_chan);
+        return nullptr;
     }
 
-    if (enable_network)
+    for (size_t i = 0; i < session_pool.loc.size(); i++)
     {
-        if (fs % 8000)
-        {
-            AUDIO_ERROR_PRINT("Network transfer doesn't support audio sample rates that are not 8K series.");
-            enable_network = false;
-        }
-        else
+        if (session_pool.loc[i].sampler->match(sample_rate, input_chan))
         {
-            encoder = std::make_unique<NetEncoder>(token, chan_num, ps, val2enum<AudioBandWidth>(fs));
+            std::swap(session_pool.loc[i], session_pool.loc.back());
+            *slot = std::move(session_pool.loc.back());
+            session_pool.loc.pop_back();
+            slot->sampler->reset();
+            slot->buffer->reset();
+            return slot;
         }
     }
+
+    slot->sampler = std::make_unique<LocEncoder>(sample_rate, fs, input_chan);
+    slot->buffer = std::make_unique<SessionData>(ps * input_chan * sizeof(int16_t), 3, input_chan, fs);
+    return slot;
 }
 
-IAStreamImpl::~IAStreamImpl()
+void OAStreamImpl::fill_session_pool()
 {
-    stop();
-    if (dtor_cb)
+    std::lock_guard<std::mutex> grd(recv_mtx);
+    session_pool.net.reserve(max_sessions);
+    while (session_pool.net.size() < session_pool_size)
     {
-        dtor_cb();
+        session_pool.net.push_back({std::make_unique<NetDecoder>(0, SESSION_MAX_CHANNEL, fs, deep_redundancy),
+                                    std::make_unique<JitterBuffer>(fs, ps, SESSION_MAX_CHANNEL), {}});
     }
 }
 
-bool IAStreamImpl::start()
+void OAStreamImpl::recycle_sessions(SessionSlots &slots)
 {
-    if (ias_ready)
+    // slots beyond the pool size are released, memory shrinks back once a burst of senders is gone.
+    for (size_t i = 0; i < slots.net.size() && session_pool.net.size() < session_pool_size; i++)
     {
-        AUDIO_INFO_PRINT("iastream :%u already start\n", token);
-        return true;
+        session_pool.net.push_back(std::move(slots.net[i]));
     }
-
-    if (enable_network)
+    for (size_t i = 0; i < slots.loc.size() && session_pool.loc.size() < session_pool_size; i++)
     {
-        sock = std::make_unique<udp::socket>(SERVICE, udp::endpoint(udp::v4(), 0));
+        session_pool.loc.push_back(std::move(slots.loc[i]));
     }
+    slots = SessionSlots();
+}
 
-    if (!idevice->start())
+size_t OAStreamImpl::evict_idle_sessions(std::chrono::steady_clock::time_point now)
+{
+    if (idle_timeout.count() == 0)
     {
-        return false;
+        return 0;
     }
 
-    ias_ready = true;
-
-    if (idevice->enable_external_loop())
+    // erase swaps the last live id into place, so walk the lists backwards.
+    size_t count = 0;
+    for (auto i = net_sessions.size(); i-- > 0;)
     {
+        auto id = net_sessions.ids()[i];
+        if (now - net_sessions.find(id)->last_active >= idle_timeout)
+        {
+            evicted.net.push_back(net_sessions.erase(id));
+            AUDIO_INFO_PRINT("idle connection: %u\n", id);
+            count++;
+        }
+    }
+
+    for (auto i = loc_sessions.size(); i-- > 0;)
+    {
+        auto id = loc_sessions.ids()[i];
+        if (now - loc_sessions.find(id)->last_active >= idle_timeout)
+        {
+            evicted.loc.push_back(loc_sessions.erase(id));
+            AUDIO_INFO_PRINT("idle connection: %u\n", id);
+            count++;
+        }
+    }
+
+    if (count)
+    {
+        publish_snapshot();
+    }
+    return count;
+}
+
+void OAStreamImpl::exec_session_sweep()
+{
+    if (!oas_ready)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> grd(recv_mtx);
+        reclaim_snapshots();
+        if (mix_retired.empty())
+        {
+            // the previous generation is unreachable now, the current one waits for the next sweep.
+            recycle_sessions(evicted_prev);
+            evicted_prev = std::move(evicted);
+            evicted = SessionSlots();
+        }
+        evict_idle_sessions(std::chrono::steady_clock::now());
+    }
+
+    sweep_timer.expires_after(SESSION_SWEEP_INTERVAL);
+    sweep_timer.async_wait([self = shared_from_this()](const asio::error_code &ec)
+                           {
+        if (ec)
+        {
+            return;
+        }
+        self->exec_session_sweep(); });
+}
+
+void OAStreamImpl::set_session_policy(int idle_timeout_ms, int max_sessions_num, int pool_size)
+{
+    {
+        std::lock_guard<std::mutex> grd(recv_mtx);
+        idle_timeout = std::chrono::milliseconds(std::max(idle_timeout_ms, 0));
+        max_sessions = (size_t)std::max(max_sessions_num, 1);
+        if (max_sessions > SessionTable<NetSession>::LIMIT)
+        {
+            max_sessions = SessionTable<NetSession>::LIMIT;
+        }
+        session_pool_size = std::min((size_t)std::max(pool_size, 0), max_sessions);
+        if (session_pool.net.size() > session_pool_size)
+        {
+            session_pool.net.erase(session_pool.net.begin() + session_pool_size, session_pool.net.end());
+        }
+        if (session_pool.loc.size() > session_pool_size)
+        {
+            session_pool.loc.erase(session_pool.loc.begin() + session_pool_size, session_pool.loc.end());
+        }
+    }
+
+    if (oas_ready)
+    {
+        fill_session_pool();
+    }
+}
+
+void OAStreamImpl::use_shared_port(uint32_t id)
+{
+    if (oas_ready)
+    {
+        AUDIO_ERROR_PRINT("oastream :%u is running, the shared port must be chosen before start\n", token);
+        return;
+    }
+    shared_port = true;
+    shared_id = id;
+}
+
+void OAStreamImpl::set_receive_shards(int shards, bool steer_by_sender)
+{
+    if (oas_ready || recv_buf)
+    {
+        AUDIO_ERROR_PRINT("oastream :%u receive shards must be chosen before the first start\n", token);
+        return;
+    }
+#ifdef AUDIO_REUSEPORT
+    recv_shards = std::min(std::max(shards, 1), PCM_RECV_SHARD_LIMIT);
+    recv_steering = steer_by_sender;
+#else
+    AUDIO_INFO_PRINT("oastream :%u receive sharding is not supported on this platform\n", token);
+#endif
+}
+
+void OAStreamImpl::set_deep_redundancy(bool enable)
+{
+    // pooled decoders keep the mode they were created with.
+    if (oas_ready || !session_pool.net.empty())
+    {
+        AUDIO_ERROR_PRINT("oastream :%u deep redundancy must be chosen before the first start\n", token);
+        return;
+    }
+#ifdef AUDIO_ENABLE_DRED
+    deep_redundancy = enable;
+#else
+    if (enable)
+    {
+        AUDIO_ERROR_PRINT("oastream :%u deep redundancy needs a build with AUDIO_DRED\n", token);
+    }
+#endif
+}
+
+void OAStreamImpl::set_active_speakers(int n)
+{
+    active_speakers = std::max(n, 0);
+    AUDIO_INFO_PRINT("oastream :%u active speakers %d\n", token, active_speakers.load());
+}
+
+bool OAStreamImpl::start_offline()
+{
+    if (oas_ready)
+    {
+        AUDIO_ERROR_PRINT("oastream :%u is already running\n", token);
+        return false;
+    }
+
+    if (!odevice->enable_external_loop())
+    {
+        AUDIO_ERROR_PRINT("oastream :%u needs a file or null device to render offline\n", token);
+        return false;
+    }
+
+    if (!odevice->start())
+    {
+        return false;
+    }
+
+    // no socket and no timers, packets and ticks come from the render.
+    oas_ready = true;
+    fill_session_pool();
+    return true;
+}
+
+void OAStreamImpl::set_callback(std::function<void(const int16_t *, int)> &&fn)
+{
+    std::lock_guard<std::mutex> grd(delv_mtx);
+    delv_cb = fn;
+}
+
+// IAStream
+IAStream::IAStream(unsigned char _token, const std::string &_hw_name, AudioBandWidth _bandwidth,
+                   AudioPeriodSize _period, bool _enable_network, bool _enable_reset,
+                   const AudioEncoderProfile &_profile)
+{
+    if (_bandwidth == AudioBandWidth::Unknown)
+    {
+        AUDIO_ERROR_PRINT("Sample rate unknown is not allowed for input stream.\n");
+        _bandwidth = AudioBandWidth::Full;
+    }
+    impl = std::make_shared<IAStreamImpl>(_token, _bandwidth, _period, _hw_name, _enable_network, _enable_reset,
+                                          _profile);
+}
+
+IAStream::IAStream(unsigned char _token, const OAStream &oas, bool _enable_network, bool _enable_auto_reset,
+                   const AudioEncoderProfile &_profile)
+{
+    impl = std::make_shared<IAStreamImpl>(_token, oas.impl, _enable_network, _enable_auto_reset, _profile);
+}
+
+IAStream::~IAStream() = default;
+
+bool IAStream::start()
+{
+    return impl->start();
+}
+
+void IAStream::mute()
+{
+    impl->mute();
+}
+
+void IAStream::unmute()
+{
+    impl->unmute();
+}
+
+void IAStream::stop()
+{
+    impl->stop();
+}
+
+void IAStream::connect(const OAStream &sink)
+{
+    impl->connect(sink.impl);
+}
+
+bool IAStream::connect(const std::string &ip, unsigned char token)
+{
+    return impl->connect(ip, token2port(token));
+}
+
+bool IAStream::connect_shared(const std::string &ip, uint32_t stream_id)
+{
+    return impl->connect_shared(ip, stream_id);
+}
+
+void IAStream::set_source_id(uint32_t id)
+{
+    impl->set_source_id(id);
+}
+
+void IAStream::set_callback(AudioInputCallBack _cb, int _ps, void *_user_data)
+{
+    impl->set_callback(_cb, _ps, _user_data);
+}
+
+void IAStream::set_capture_handoff(bool enable)
+{
+    impl->set_capture_handoff(enable);
+}
+
+void IAStream::set_encoder_profile(const AudioEncoderProfile &profile)
+{
+    impl->set_encoder_profile(profile);
+}
+
+IAStreamImpl::IAStreamImpl(unsigned char _token, AudioBandWidth _bandwidth, AudioPeriodSize _period,
+                           const std::string &_hw_name, bool _enable_network, bool _enable_reset,
+                           const AudioEncoderProfile &_profile)
+    : token(_token), enable_network(_enable_network), hw_name(_hw_name), fs(enum2val(_bandwidth)),
+      ps(fs / 1000 * (enum2val(_period))), chan_num(0), max_chan(0), muted(false), timer0(SERVICE),
+      usr_cb(nullptr), usr_data(nullptr), ias_ready(false), offline(nullptr), enable_handoff(false),
+      handoff_running(false)
+{
+    if (_hw_name.find(".wav") != std::string::npos)
+    {
+        idevice = std::make_unique<WaveIADevice>(BULK_SERVICE);
+    }
+    else if (_hw_name.find(".multi") != std::string::npos)
+    {
+        idevice = std::make_unique<MultiIADevice>(0, 8, 16);
+    }
+    else if (NullIADevice::match(_hw_name))
+    {
+        idevice = std::make_unique<NullIADevice>();
+    }
+    else
+    {
+        idevice = std::make_unique<PhsyIADevice>();
+    }
+    timer1 = std::make_unique<asio::steady_timer>(idevice->blocking_task() ? BULK_SERVICE : SERVICE);
+
+    if (idevice->create(_hw_name, this, fs, ps, chan_num, max_chan))
+    {
+        // session for raw data
+        session = std::make_unique<SessionData>(PCM_CUSTOM_PERIOD_SIZE * max_chan * sizeof(int16_t), 2, max_chan);
+    }
+
+    if (enable_network)
+    {
+        encoder = std::make_unique<NetEncoder>(token, chan_num, ps, _bandwidth, _profile);
+    }
+
+    if (_enable_reset)
+    {
+        reset_phsy_device();
+    }
+}
+
+IAStreamImpl::IAStreamImpl(unsigned char _token, const std::shared_ptr<OAStreamImpl> &oas, bool _enable_network,
+                           bool _enable_reset, const AudioEncoderProfile &_profile)
+    : token(_token), enable_network(_enable_network), hw_name(""), fs(enum2val(AudioBandWidth::Full)),
+      ps(fs / 1000 * (enum2val(AudioPeriodSize::INR_10MS))), chan_num(0), max_chan(0), muted(false), timer0(SERVICE),
+      usr_cb(nullptr), usr_data(nullptr), ias_ready(false), offline(nullptr), enable_handoff(false),
+      handoff_running(false)
+{
+    idevice = std::make_unique<PipeIADevice>(oas);
+    timer1 = std::make_unique<asio::steady_timer>(SERVICE);
+    if (idevice->create(hw_name, this, fs, ps, chan_num, max_chan))
+    {
+        // session for raw data
+        session = std::make_unique<SessionData>(PCM_CUSTOM_PERIOD_SIZE * max_chan * sizeof(int16_t), 2, max_chan);
+    }
+
+    if (enable_network)
+    {
+        if (fs % 8000)
+        {
+            AUDIO_ERROR_PRINT("Network transfer doesn't support audio sample rates that are not 8K series.");
+            enable_network = false;
+        }
+        else
+        {
+            encoder = std::make_unique<NetEncoder>(token, chan_num, ps, val2enum<AudioBandWidth>(fs), _profile);
+        }
+    }
+}
+
+IAStreamImpl::~IAStreamImpl()
+{
+    stop();
+    stop_handoff();
+    if (dtor_cb)
+    {
+        dtor_cb();
+    }
+}
+
+bool IAStreamImpl::start()
+{
+    if (ias_ready)
+    {
+        AUDIO_INFO_PRINT("iastream :%u already start\n", token);
+        return true;
+    }
+
+    if (enable_network)
+    {
+        sock = std::make_unique<udp::socket>(SERVICE, udp::endpoint(udp::v4(), 0));
+    }
+
+    start_handoff();
+    if (!idevice->start())
+    {
+        stop_handoff();
+        return false;
+    }
+
+    ias_ready = true;
+
+    if (idevice->enable_external_loop())
+    {
+        clock.reset(fs, ps, std::chrono::steady_clock::now());
         exec_external_loop();
     }
 
     if (usr_cb)
     {
+        usr_clock.reset(enum2val(AudioBandWidth::Full), usr_ps, std::chrono::steady_clock::now());
         copy_pcm_frames();
     }
 
@@ -486,16 +1143,42 @@ void IAStreamImpl::stop()
     {
         ias_ready = false;
     }
+    // the worker holds this, it has to go even if the device refused to stop.
+    stop_handoff();
     AUDIO_INFO_PRINT("stop iastream :%u\n", token);
 }
 
+bool IAStreamImpl::start_offline(AudioOfflineRenderImpl *render)
+{
+    if (ias_ready)
+    {
+        AUDIO_ERROR_PRINT("iastream :%u is already running\n", token);
+        return false;
+    }
+
+    if (!idevice->enable_external_loop())
+    {
+        AUDIO_ERROR_PRINT("iastream :%u needs a file or null device to render offline\n", token);
+        return false;
+    }
+
+    if (!idevice->start())
+    {
+        return false;
+    }
+
+    offline = render;
+    ias_ready = true;
+    return true;
+}
+
 void IAStreamImpl::connect(const std::shared_ptr<OAStreamImpl> &sink)
 {
     std::lock_guard<std::mutex> grd(dest_mtx);
     loc_dests.emplace_back(sink);
 }
 
-bool IAStreamImpl::connect(const std::string &ip, uint16_t port)
+bool IAStreamImpl::connect(const std::string &ip, uint16_t port, uint32_t dest_id)
 {
     if (!enable_network)
     {
@@ -503,55 +1186,167 @@ bool IAStreamImpl::connect(const std::string &ip, uint16_t port)
         return false;
     }
 
+    // the result is needed before returning, so resolution blocks the caller whatever executor it is bound to.
     udp::resolver resolver(SERVICE);
     asio::error_code ec;
 
-    auto dest = *resolver.resolve(udp::v4(), ip, std::to_string(port), ec).begin();
+    auto results = resolver.resolve(udp::v4(), ip, std::to_string(port), ec);
+    if (ec || results.empty())
+    {
+        AUDIO_ERROR_PRINT("%s: %s\n", ip.c_str(), ec ? ec.message().c_str() : "no address");
+        return false;
+    }
+    auto dest = *results.begin();
+    std::lock_guard<std::mutex> grd(dest_mtx);
+    net_dests.push_back(std::move(dest));
+    net_dest_ids.push_back(dest_id);
+    return true;
+}
+
+bool IAStreamImpl::connect_shared(const std::string &ip, uint32_t stream_id)
+{
+    if (!connect(ip, AUDIO_SHARED_PORT, stream_id))
+    {
+        return false;
+    }
+    // the shared port only accepts extended packets, the source id defaults to the token.
+    encoder->enable_extension();
+    return true;
+}
+
+void IAStreamImpl::set_source_id(uint32_t id)
+{
+    if (!encoder)
+    {
+        AUDIO_INFO_PRINT("iastream :%u has no network encoder\n", token);
+        return;
+    }
+    encoder->set_source(id);
+}
+
+void IAStreamImpl::set_callback(AudioInputCallBack _cb, int _ps, void *_user_data)
+{
+    usr_cb = _cb;
+    usr_ps = _ps;
+    usr_data = _user_data;
+}
+
+void IAStreamImpl::set_capture_handoff(bool enable)
+{
+    enable_handoff = enable;
+}
+
+void IAStreamImpl::set_encoder_profile(const AudioEncoderProfile &profile)
+{
+    if (!encoder)
+    {
+        AUDIO_INFO_PRINT("iastream :%u has no network encoder\n", token);
+        return;
+    }
+    encoder->set_profile(profile);
+}
+
+void IAStreamImpl::set_destory_callback(std::function<void()> &&_cb)
+{
+    dtor_cb = _cb;
+}
+
+void IAStreamImpl::reset_phsy_device()
+{
+    auto ttimer = std::make_shared<asio::steady_timer>(BULK_SERVICE);
+    ttimer->expires_from_now(PHSY_DEVICE_RESRT_INTERVAL);
+    ttimer->async_wait([this, ttimer](asio::error_code ec)
+                       {
     if (ec)
     {
-        AUDIO_ERROR_PRINT("%s\n", ec.message().c_str());
+        return;
+    }
+    if (!dynamic_cast<PhsyIADevice *>(&(*idevice)))
+    {
+        return;
+    }
+    if (idevice->stop())
+    {
+        stop_handoff();
+        idevice.reset(new PhsyIADevice);
+        if (idevice->create(hw_name, this, fs, ps, chan_num, max_chan))
+        {
+            start_handoff();
+            idevice->start();
+        }
+    }
+    reset_phsy_device(); });
+}
+
+bool IAStreamImpl::handoff_pcm_frames(const int16_t *input, int frame_number)
+{
+    if (!handoff_running.load(std::memory_order_acquire))
+    {
         return false;
     }
-    std::lock_guard<std::mutex> grd(dest_mtx);
-    net_dests.push_back(std::move(dest));
+
+    // never fall back to inline processing here, an overrun only drops this period.
+    if (frame_number <= HANDOFF_MAX_FRAMES)
+    {
+        int16_t head[HANDOFF_RECORD_HEAD] = {(int16_t)frame_number, 0};
+        if (handoff_ring->push(head, HANDOFF_RECORD_HEAD, input, frame_number * max_chan))
+        {
+            handoff_wake->post();
+        }
+    }
     return true;
 }
 
-void IAStreamImpl::set_callback(AudioInputCallBack _cb, int _ps, void *_user_data)
+void IAStreamImpl::start_handoff()
 {
-    usr_cb = _cb;
-    usr_ps = _ps;
-    usr_data = _user_data;
-}
+    if (!enable_handoff || handoff_running || idevice->enable_external_loop())
+    {
+        return;
+    }
 
-void IAStreamImpl::set_destory_callback(std::function<void()> &&_cb)
-{
-    dtor_cb = _cb;
+    handoff_ring = std::make_unique<SpscRing>(HANDOFF_QUEUE_DEPTH * (HANDOFF_RECORD_HEAD + HANDOFF_MAX_FRAMES * max_chan));
+    handoff_buf.resize(HANDOFF_MAX_FRAMES * max_chan);
+    handoff_wake = std::make_unique<WakeSignal>();
+    handoff_running = true;
+    handoff_thd = std::thread(&IAStreamImpl::exec_handoff_loop, this);
 }
 
-void IAStreamImpl::reset_phsy_device()
+void IAStreamImpl::stop_handoff()
 {
-    auto ttimer = std::make_shared<asio::steady_timer>(SERVICE);
-    ttimer->expires_from_now(PHSY_DEVICE_RESRT_INTERVAL);
-    ttimer->async_wait([this, ttimer](asio::error_code ec)
-                       {
-    if (ec)
+    if (!handoff_running)
     {
         return;
     }
-    if (!dynamic_cast<PhsyIADevice *>(&(*idevice)))
+
+    handoff_running = false;
+    handoff_wake->post();
+    if (handoff_thd.joinable())
     {
-        return;
+        handoff_thd.join();
     }
-    if (idevice->stop())
+}
+
+void IAStreamImpl::exec_handoff_loop()
+{
+    AudioService::GetService().configure_realtime_thread("audio_handoff");
+    int16_t head[HANDOFF_RECORD_HEAD];
+    // the capture callback posts once per pushed period, a condition variable would need its mutex there.
+    // surplus posts only cost an empty pass over the ring.
+    while (true)
     {
-        idevice.reset(new PhsyIADevice);
-        if (idevice->create(hw_name, this, fs, ps, chan_num, max_chan))
+        handoff_wake->wait();
+        if (!handoff_running)
         {
-            idevice->start();
+            break;
+        }
+
+        while (handoff_ring->pop(head, HANDOFF_RECORD_HEAD))
+        {
+            auto frame_number = (int)(uint16_t)head[0];
+            handoff_ring->pop(handoff_buf.data(), frame_number * max_chan);
+            idevice->process_pcm_data(handoff_buf.data(), frame_number);
         }
     }
-    reset_phsy_device(); });
 }
 
 void IAStreamImpl::set_resampler_parameter(int fsi, int fso, int chan)
@@ -590,13 +1385,27 @@ void IAStreamImpl::read_pcm_frames(const int16_t *input, int frame_number)
         return;
     }
 
+    // a capture period may complete no packet or several, depending on the packet duration.
+    encoder->push((const char *)input, frame_number * sizeof(int16_t) * chan_num);
     size_t len = 0;
-    auto &msg = encoder->prepare((const char *)input, frame_number * sizeof(int16_t) * chan_num, len);
-    for (const auto &dest : net_dests)
+    for (auto *msg = &encoder->prepare(len); len > 0; msg = &encoder->prepare(len))
     {
-        sock->async_send_to(msg.data(), dest, [](std::error_code, std::size_t) {});
+        send_packet((const char *)msg->data().data(), len);
+        msg->consume(len);
     }
-    msg.consume(len + sizeof(PacketHeader));
+}
+
+void IAStreamImpl::send_packet(const char *data, size_t size)
+{
+    if (offline)
+    {
+        for (size_t i = 0; i < net_dests.size(); i++)
+        {
+            offline->deliver(data, size, net_dests[i], net_dest_ids[i]);
+        }
+        return;
+    }
+    send_to_all(*sock, data, size, net_dests, net_dest_ids.data());
 }
 
 void IAStreamImpl::copy_pcm_frames()
@@ -605,9 +1414,13 @@ void IAStreamImpl::copy_pcm_frames()
     {
         return;
     }
-    session->load_data(usr_ps * max_chan * sizeof(int16_t));
-    usr_cb((int16_t *)session->out_buf, max_chan, usr_ps, usr_data);
-    timer0.expires_after(asio::chrono::microseconds(usr_ps * 1000 / 48 - OS_CLK_OFFSET));
+    auto due = usr_clock.advance(std::chrono::steady_clock::now());
+    for (int i = 0; i < due; i++)
+    {
+        session->load_data(usr_ps * max_chan * sizeof(int16_t));
+        usr_cb((int16_t *)session->out_buf, max_chan, usr_ps, usr_data);
+    }
+    timer0.expires_at(usr_clock.deadline());
     timer0.async_wait([self = shared_from_this()](const asio::error_code &ec)
                       {
         if (ec)
@@ -623,13 +1436,16 @@ void IAStreamImpl::exec_external_loop()
     {
         return;
     }
-    auto interval = ceil_div(ps * 1000, fs);
-    if (!idevice->async_task(interval))
+    auto due = clock.advance(std::chrono::steady_clock::now());
+    for (int i = 0; i < due; i++)
     {
-        return;
+        if (!idevice->async_task(ps))
+        {
+            return;
+        }
     }
-    timer1.expires_after(asio::chrono::microseconds(1000 * interval - OS_CLK_OFFSET));
-    timer1.async_wait([self = shared_from_this()](const asio::error_code &ec)
+    timer1->expires_at(clock.deadline());
+    timer1->async_wait([self = shared_from_this()](const asio::error_code &ec)
                       {
         if (ec)
         {
@@ -638,6 +1454,449 @@ void IAStreamImpl::exec_external_loop()
         self->exec_external_loop(); });
 }
 
+// AudioOfflineRender
+AudioOfflineRender::AudioOfflineRender()
+{
+    impl = std::make_unique<AudioOfflineRenderImpl>();
+}
+
+AudioOfflineRender::~AudioOfflineRender() = default;
+
+bool AudioOfflineRender::add(const IAStream &ias)
+{
+    return impl->add(ias.impl);
+}
+
+bool AudioOfflineRender::add(const OAStream &oas)
+{
+    return impl->add(oas.impl);
+}
+
+bool AudioOfflineRender::render(int ms)
+{
+    return impl->render(ms);
+}
+
+int64_t AudioOfflineRender::elapsed_ms() const
+{
+    return impl->elapsed_ms();
+}
+
+AudioOfflineRenderImpl::AudioOfflineRenderImpl()
+    : origin(std::chrono::steady_clock::now()), now(origin)
+{
+}
+
+AudioOfflineRenderImpl::~AudioOfflineRenderImpl()
+{
+    for (auto &input : inputs)
+    {
+        input.stream->stop();
+        input.stream->offline = nullptr;
+    }
+    for (auto &output : outputs)
+    {
+        output->stop();
+    }
+}
+
+bool AudioOfflineRenderImpl::add(const std::shared_ptr<IAStreamImpl> &ias)
+{
+    if (!ias->start_offline(this))
+    {
+        return false;
+    }
+    ias->clock.reset(ias->fs, ias->ps, now);
+    inputs.push_back({ias, true});
+    return true;
+}
+
+bool AudioOfflineRenderImpl::add(const std::shared_ptr<OAStreamImpl> &oas)
+{
+    if (!oas->start_offline())
+    {
+        return false;
+    }
+    oas->clock.reset(oas->fs, oas->ps, now);
+    outputs.push_back(oas);
+    return true;
+}
+
+bool AudioOfflineRenderImpl::render(int ms)
+{
+    // every stream runs on this thread, so the virtual clock covers the whole graph.
+    bind_virtual_clock(&now);
+    auto end = now + std::chrono::milliseconds(std::max(ms, 0));
+    while (true)
+    {
+        auto next = end;
+        for (const auto &input : inputs)
+        {
+            if (input.live)
+            {
+                next = std::min(next, input.stream->clock.deadline());
+            }
+        }
+        for (const auto &output : outputs)
+        {
+            next = std::min(next, output->clock.deadline());
+        }
+        if (next >= end)
+        {
+            break;
+        }
+
+        // inputs run before outputs at the same instant, a packet is mixed in the period it was sent.
+        now = next;
+        for (auto &input : inputs)
+        {
+            auto due = input.live ? input.stream->clock.advance(now) : 0;
+            for (int i = 0; i < due && input.live; i++)
+            {
+                input.live = input.stream->idevice->async_task(input.stream->ps);
+            }
+        }
+        for (const auto &output : outputs)
+        {
+            auto due = output->clock.advance(now);
+            for (int i = 0; i < due; i++)
+            {
+                output->odevice->async_task(output->ps);
+            }
+        }
+    }
+    now = end;
+    bind_virtual_clock(nullptr);
+
+    return std::any_of(inputs.cbegin(), inputs.cend(), [](const Input &input) { return input.live; });
+}
+
+int64_t AudioOfflineRenderImpl::elapsed_ms() const
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(now - origin).count();
+}
+
+void AudioOfflineRenderImpl::deliver(const char *data, size_t len, const udp::endpoint &dest, uint32_t dest_id)
+{
+    // addresses are ignored, every stream of the render is local.
+    for (const auto &output : outputs)
+    {
+        if (!output->enable_network)
+        {
+            continue;
+        }
+
+        if (output->shared_port && dest.port() == AUDIO_SHARED_PORT && output->shared_id == dest_id &&
+            PacketHeader::extended(data))
+        {
+            scratch.assign(data, data + len);
+            PacketHeader::set_destination(scratch.data(), dest_id);
+            output->handle_packet(scratch.data(), len);
+        }
+        else if (!output->shared_port && dest.port() == token2port(output->token))
+        {
+            output->handle_packet(data, len);
+        }
+    }
+}
+
+// AudioRelay
+AudioRelay::AudioRelay(unsigned char _token, int _shards)
+{
+    impl = std::make_shared<AudioRelayImpl>(_token, _shards);
+}
+
+AudioRelay::~AudioRelay() = default;
+
+bool AudioRelay::start()
+{
+    return impl->start();
+}
+
+void AudioRelay::stop()
+{
+    impl->stop();
+}
+
+int AudioRelay::connect(const std::string &ip, unsigned char token)
+{
+    return impl->connect(ip, token2port(token), 0, false);
+}
+
+int AudioRelay::connect_shared(const std::string &ip, uint32_t stream_id)
+{
+    return impl->connect(ip, AUDIO_SHARED_PORT, stream_id, true);
+}
+
+void AudioRelay::disconnect(int subscriber)
+{
+    impl->disconnect(subscriber);
+}
+
+void AudioRelay::set_filter(int subscriber, const std::vector<uint32_t> &senders)
+{
+    impl->set_filter(subscriber, senders);
+}
+
+AudioRelayImpl::AudioRelayImpl(unsigned char _token, int _shards)
+    : token(_token), recv_shards(1), recv_buf(nullptr), relay_ready(false), next_subscriber(0),
+      routes(new RelayRoutes)
+{
+#ifdef AUDIO_REUSEPORT
+    recv_shards = std::min(std::max(_shards, 1), PCM_RECV_SHARD_LIMIT);
+#else
+    if (_shards > 1)
+    {
+        AUDIO_INFO_PRINT("relay :%u receive sharding is not supported on this platform\n", token);
+    }
+#endif
+    route_hazards.reset(new std::atomic<const RelayRoutes *>[recv_shards]);
+    for (int i = 0; i < recv_shards; i++)
+    {
+        route_hazards[i] = nullptr;
+    }
+}
+
+AudioRelayImpl::~AudioRelayImpl()
+{
+    socks.clear();
+    delete[] recv_buf;
+    delete routes.load();
+}
+
+bool AudioRelayImpl::start()
+{
+    if (relay_ready)
+    {
+        return true;
+    }
+
+    // the sockets stay open once bound, stop() only pauses forwarding.
+    if (socks.empty())
+    {
+#ifdef AUDIO_REUSEPORT
+        if (!open_port_shards(SERVICE, token2port(token), recv_shards, true, socks))
+        {
+            return false;
+        }
+#else
+        try
+        {
+            socks.push_back(std::make_unique<udp::socket>(SERVICE, udp::endpoint(udp::v4(), token2port(token))));
+        }
+        catch (const std::exception &e)
+        {
+            AUDIO_ERROR_PRINT("%s\n", e.what());
+            return false;
+        }
+#endif
+        recv_buf = new char[socks.size() * PCM_RECV_BATCH_SIZE * PCM_RECV_BUFFER_SIZE];
+        for (size_t i = 0; i < socks.size(); i++)
+        {
+            asio::post(SERVICE, [self = shared_from_this(), i]()
+                       { self->do_receive(i); });
+        }
+    }
+
+    relay_ready = true;
+    AUDIO_INFO_PRINT("start relay :%u\n", token);
+    return true;
+}
+
+void AudioRelayImpl::stop()
+{
+    if (relay_ready.exchange(false))
+    {
+        AUDIO_INFO_PRINT("stop relay :%u\n", token);
+    }
+}
+
+int AudioRelayImpl::connect(const std::string &ip, uint16_t port, uint32_t dest_id, bool shared)
+{
+    // resolved on the calling thread, see IAStreamImpl::connect.
+    udp::resolver resolver(SERVICE);
+    asio::error_code ec;
+
+    auto results = resolver.resolve(udp::v4(), ip, std::to_string(port), ec);
+    if (ec || results.empty())
+    {
+        AUDIO_ERROR_PRINT("%s: %s\n", ip.c_str(), ec ? ec.message().c_str() : "no address");
+        return -1;
+    }
+    auto dest = *results.begin();
+
+    std::lock_guard<std::mutex> grd(ctl_mtx);
+    subscribers.push_back({next_subscriber, dest, dest_id, shared, {}});
+    publish_routes();
+    return next_subscriber++;
+}
+
+void AudioRelayImpl::disconnect(int subscriber)
+{
+    std::lock_guard<std::mutex> grd(ctl_mtx);
+    subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(),
+                                     [subscriber](const RelaySubscriber &s) { return s.id == subscriber; }),
+                      subscribers.end());
+    publish_routes();
+}
+
+void AudioRelayImpl::set_filter(int subscriber, const std::vector<uint32_t> &senders)
+{
+    std::lock_guard<std::mutex> grd(ctl_mtx);
+    for (auto &s : subscribers)
+    {
+        if (s.id == subscriber)
+        {
+            s.senders = senders;
+            std::sort(s.senders.begin(), s.senders.end());
+            s.senders.erase(std::unique(s.senders.begin(), s.senders.end()), s.senders.end());
+        }
+    }
+    publish_routes();
+}
+
+void AudioRelayImpl::publish_routes()
+{
+    // called with ctl_mtx held, the receive path never blocks on it.
+    routes_retired.emplace_back(routes.exchange(RelayRoutes::build(subscribers).release()));
+    routes_retired.erase(std::remove_if(routes_retired.begin(), routes_retired.end(),
+                                        [this](const std::unique_ptr<const RelayRoutes> &r)
+                                        {
+                                            for (int i = 0; i < recv_shards; i++)
+                                            {
+                                                if (route_hazards[i].load() == r.get())
+                                                {
+                                                    return false;
+                                                }
+                                            }
+                                            return true;
+                                        }),
+                         routes_retired.end());
+}
+
+void AudioRelayImpl::do_receive(size_t shard)
+{
+    // the receive chain only holds a weak reference, destroying the relay closes the sockets and ends it.
+    auto buf = recv_buf + shard * PCM_RECV_BATCH_SIZE * PCM_RECV_BUFFER_SIZE;
+    std::weak_ptr<AudioRelayImpl> weak = shared_from_this();
+#ifdef AUDIO_BATCH_IO
+    socks[shard]->async_wait(udp::socket::wait_read,
+                             [weak, shard, buf](std::error_code ec)
+                             {
+                                 auto self = weak.lock();
+                                 if (!self)
+                                 {
+                                     return;
+                                 }
+                                 if (!ec)
+                                 {
+                                     size_t lens[PCM_RECV_BATCH_SIZE];
+                                     int count = 0;
+                                     do
+                                     {
+                                         count = batch_receive(self->socks[shard]->native_handle(), buf,
+                                                               PCM_RECV_BUFFER_SIZE, lens, PCM_RECV_BATCH_SIZE);
+                                         for (int i = 0; i < count; i++)
+                                         {
+                                             self->forward_packet(shard, buf + i * PCM_RECV_BUFFER_SIZE, lens[i]);
+                                         }
+                                     } while (count == PCM_RECV_BATCH_SIZE);
+                                 }
+                                 self->do_receive(shard);
+                             });
+#else
+    static udp::endpoint sender_endpoint;
+    socks[shard]->async_receive_from(asio::buffer(buf, PCM_RECV_BUFFER_SIZE), sender_endpoint,
+                                     [weak, shard, buf](std::error_code ec, std::size_t bytes)
+                                     {
+                                         auto self = weak.lock();
+                                         if (!self)
+                                         {
+                                             return;
+                                         }
+                                         if (!ec)
+                                         {
+                                             self->forward_packet(shard, buf, bytes);
+                                         }
+                                         self->do_receive(shard);
+                                     });
+#endif
+}
+
+void AudioRelayImpl::forward_packet(size_t shard, const char *data, size_t bytes)
+{
+    // packets are forwarded as they arrived, only the destination id is rewritten per subscriber.
+    if (!relay_ready.load(std::memory_order_relaxed) || !PacketHeader::validate(data, bytes))
+    {
+        return;
+    }
+
+    // single reader hazard pointer per shard, retries only if the routes are republished in between.
+    auto &hazard = route_hazards[shard];
+    const RelayRoutes *table = nullptr;
+    do
+    {
+        table = routes.load();
+        hazard.store(table);
+    } while (table != routes.load());
+
+    const auto &route = table->find(PacketHeader::source(data));
+    if (PacketHeader::extended(data))
+    {
+        send_to_all(*socks[shard], data, bytes, route.dests, route.dest_ids.data());
+    }
+    else
+    {
+        send_to_all(*socks[shard], data, bytes, route.legacy_dests);
+    }
+    hazard.store(nullptr, std::memory_order_release);
+}
+
+std::unique_ptr<RelayRoutes> RelayRoutes::build(const std::vector<RelaySubscriber> &subscribers)
+{
+    auto table = std::make_unique<RelayRoutes>();
+    auto add = [](RelayRoute &route, const RelaySubscriber &s)
+    {
+        route.dests.push_back(s.dest);
+        route.dest_ids.push_back(s.dest_id);
+        if (!s.shared)
+        {
+            route.legacy_dests.push_back(s.dest);
+        }
+    };
+
+    for (const auto &s : subscribers)
+    {
+        for (auto sender : s.senders)
+        {
+            table->filtered.emplace(sender, RelayRoute());
+        }
+    }
+    for (const auto &s : subscribers)
+    {
+        if (!s.senders.empty())
+        {
+            for (auto sender : s.senders)
+            {
+                add(table->filtered[sender], s);
+            }
+            continue;
+        }
+        add(table->unfiltered, s);
+        for (auto &route : table->filtered)
+        {
+            add(route.second, s);
+        }
+    }
+    return table;
+}
+
+const RelayRoute &RelayRoutes::find(uint32_t sender) const
+{
+    auto iter = filtered.find(sender);
+    return iter != filtered.end() ? iter->second : unfiltered;
+}
+
 // AudioPlayer
 AudioPlayer::AudioPlayer(unsigned char _token)
 {
@@ -3,12 +3,18 @@
 
 #include "asio.hpp"
 #include "audio_interface.h"
+#include <array>
 #include <atomic>
+#include <chrono>
 #include <functional>
 #include <map>
 #include <mutex>
+#include <thread>
 
+class SpscRing;
+class WakeSignal;
 class SessionData;
+class JitterBuffer;
 class LocEncoder;
 class NetEncoder;
 class NetDecoder;
@@ -21,29 +27,227 @@ using decoder_ptr = std::unique_ptr<NetDecoder>;
 using encoder_ptr = std::unique_ptr<NetEncoder>;
 using sampler_ptr = std::unique_ptr<LocEncoder>;
 using session_ptr = std::unique_ptr<SessionData>;
+using jitter_ptr = std::unique_ptr<JitterBuffer>;
 using sampler_ptr = std::unique_ptr<LocEncoder>;
 using net_endpoints = std::vector<asio::ip::udp::endpoint>;
 using loc_endpoints = std::vector<std::weak_ptr<OAStreamImpl>>;
 
+struct MixSnapshot
+{
+  std::vector<JitterBuffer *> net;
+  std::vector<SessionData *> loc;
+  // scratch for speaker selection, reserved on publish so the mixer never allocates.
+  std::vector<std::pair<float, size_t>> rank;
+};
+
+struct NetSession
+{
+  decoder_ptr decoder;
+  jitter_ptr buffer;
+  std::chrono::steady_clock::time_point last_active;
+};
+
+struct LocSession
+{
+  sampler_ptr sampler;
+  session_ptr buffer;
+  std::chrono::steady_clock::time_point last_active;
+};
+
+struct SessionSlots
+{
+  std::vector<NetSession> net;
+  std::vector<LocSession> loc;
+};
+
+// open-addressing table keyed by sender, legacy 8-bit tokens occupy keys 0-255 and 32-bit source ids are
+// tagged above them.
+// a compact list of the live ids is kept alongside so iteration is proportional to the session count,
+// erase shifts the following entries back instead of leaving tombstones.
+template <typename T>
+class SessionTable
+{
+public:
+  static constexpr size_t CAPACITY = 1024;
+  // kept at half load so that probe sequences stay short.
+  static constexpr size_t LIMIT = CAPACITY / 2;
+
+  SessionTable() : positions{}
+  {
+    keys.fill((uint64_t)EMPTY);
+    live.reserve(LIMIT);
+  }
+
+  T *find(uint64_t id)
+  {
+    auto idx = lookup(id);
+    return idx < CAPACITY ? &slots[idx] : nullptr;
+  }
+
+  bool contains(uint64_t id) const
+  {
+    return lookup(id) < CAPACITY;
+  }
+
+  // returns nullptr once LIMIT ids are live.
+  T *insert(uint64_t id)
+  {
+    auto idx = hash(id);
+    while (keys[idx] != EMPTY)
+    {
+      if (keys[idx] == id)
+      {
+        return &slots[idx];
+      }
+      idx = (idx + 1) & MASK;
+    }
+
+    if (id == EMPTY || live.size() >= LIMIT)
+    {
+      return nullptr;
+    }
+    keys[idx] = id;
+    positions[idx] = (uint16_t)live.size();
+    live.push_back(id);
+    return &slots[idx];
+  }
+
+  T erase(uint64_t id)
+  {
+    auto idx = lookup(id);
+    if (idx >= CAPACITY)
+    {
+      return T();
+    }
+
+    auto pos = positions[idx];
+    live[pos] = live.back();
+    positions[lookup(live[pos])] = pos;
+    live.pop_back();
+
+    T result = std::move(slots[idx]);
+    auto hole = idx;
+    for (auto next = (hole + 1) & MASK; keys[next] != EMPTY; next = (next + 1) & MASK)
+    {
+      // an entry may fill the hole only if the hole lies between its home slot and where it sits.
+      if (((next - hash(keys[next])) & MASK) >= ((next - hole) & MASK))
+      {
+        keys[hole] = keys[next];
+        slots[hole] = std::move(slots[next]);
+        positions[hole] = positions[next];
+        hole = next;
+      }
+    }
+    keys[hole] = EMPTY;
+    slots[hole] = T();
+    return result;
+  }
+
+  const std::vector<uint64_t> &ids() const
+  {
+    return live;
+  }
+
+  size_t size() const
+  {
+    return live.size();
+  }
+
+private:
+  static constexpr uint64_t EMPTY = ~0ULL;
+  static constexpr size_t MASK = CAPACITY - 1;
+
+  static size_t hash(uint64_t id)
+  {
+    return (size_t)(((uint32_t)(id ^ (id >> 32)) * 2654435761u) >> 22);
+  }
+
+  size_t lookup(uint64_t id) const
+  {
+    for (auto idx = hash(id); keys[idx] != EMPTY; idx = (idx + 1) & MASK)
+    {
+      if (keys[idx] == id)
+      {
+        return idx;
+      }
+    }
+    return CAPACITY;
+  }
+
+private:
+  std::array<uint64_t, CAPACITY> keys;
+  std::array<T, CAPACITY> slots;
+  std::array<uint16_t, CAPACITY> positions;
+  std::vector<uint64_t> live;
+};
+
+// paces a periodic task by absolute deadlines derived from the frame count, so late wake-ups never
+// accumulate. late periods are caught up, a stall longer than the catch-up window is skipped.
+class MediaClock
+{
+public:
+  using time_point = std::chrono::steady_clock::time_point;
+
+  MediaClock();
+
+  void reset(int _fs, int _ps, time_point now);
+
+  // periods due at now, the first period after reset is due immediately.
+  int advance(time_point now);
+
+  time_point deadline() const;
+
+private:
+  int fs;
+  int ps;
+  time_point origin;
+  uint64_t periods;
+  uint64_t late_wakeups;
+};
+
 class AudioService
 {
 public:
   static AudioService &GetService();
 
-  void start();
+  void start(const AudioServiceConfig &_config);
 
   void stop();
 
   asio::io_context &executor();
 
+  // blocking work goes here so that it never delays a real-time handler.
+  asio::io_context &bulk_executor();
+
+  // applies the real-time policy to a thread the service doesn't own, like a capture hand-off.
+  void configure_realtime_thread(const char *name);
+
+  // the shared port is opened on the first attach and serves every attached stream of the process.
+  bool attach_stream(uint32_t id, const std::shared_ptr<OAStreamImpl> &oas);
+
+  void detach_stream(uint32_t id);
+
 private:
   AudioService();
   ~AudioService() = default;
 
+  void do_shared_receive();
+
+  void dispatch_shared_packet(const char *data, size_t bytes);
+
 private:
+  AudioServiceConfig config;
   asio::io_context io_ctx;
+  asio::io_context bulk_ctx;
   std::vector<std::thread> io_thds;
   asio::executor_work_guard<asio::io_context::executor_type> work_guard;
+  asio::executor_work_guard<asio::io_context::executor_type> bulk_guard;
+
+  std::mutex shared_mtx;
+  usocket_ptr shared_sock;
+  std::vector<char> shared_buf;
+  asio::ip::udp::endpoint shared_sender;
+  std::map<uint32_t, std::weak_ptr<OAStreamImpl>> shared_streams;
 };
 
 class OAStreamImpl : public std::enable_shared_from_this<OAStreamImpl>
@@ -51,7 +255,10 @@ class OAStreamImpl : public std::enable_shared_from_this<OAStreamImpl>
   friend class PhsyOADevice;
   friend class WaveOADevice;
   friend class MultiOADevice;
+  friend class NullOADevice;
   friend class PipeIADevice;
+  friend class AudioService;
+  friend class AudioOfflineRenderImpl;
 
 public:
   OAStreamImpl(unsigned char _token, AudioBandWidth _bandwidth, AudioPeriodSize _period, const std::string &_hw_name,
@@ -64,6 +271,10 @@ public:
 
   void unmute(unsigned char _token);
 
+  void mute_source(uint32_t source_id);
+
+  void unmute_source(uint32_t source_id);
+
   void stop();
 
   void direct_push_pcm(uint8_t input_token, uint8_t input_chan, int input_period, int sample_rate,
@@ -71,29 +282,87 @@ public:
 
   void set_callback(std::function<void(const int16_t *, int)> &&fn);
 
+  void set_active_speakers(int n);
+
+  void set_session_policy(int idle_timeout_ms, int max_sessions_num, int pool_size);
+
+  void use_shared_port(uint32_t id);
+
+  void set_receive_shards(int shards, bool steer_by_sender);
+
+  void set_deep_redundancy(bool enable);
+
 private:
-  void do_receive();
+  void do_receive(size_t shard);
+
+  void handle_packet(const char *data, size_t bytes);
 
   void write_pcm_frames(int16_t *output, int frame_number);
 
   void exec_external_loop();
 
+  void publish_snapshot();
+
+  MixSnapshot *acquire_snapshot();
+
+  void release_snapshot();
+
+  void select_speakers(MixSnapshot *snapshot, int n);
+
+  void reclaim_snapshots();
+
+  bool admit_session(std::chrono::steady_clock::time_point now);
+
+  NetSession *open_net_session(uint64_t sender, uint8_t chan);
+
+  LocSession *open_loc_session(uint8_t input_token, uint8_t input_chan, int sample_rate);
+
+  void fill_session_pool();
+
+  void recycle_sessions(SessionSlots &slots);
+
+  size_t evict_idle_sessions(std::chrono::steady_clock::time_point now);
+
+  void exec_session_sweep();
+
+  bool start_offline();
+
 private:
   const unsigned char token;
   bool enable_network;
+  bool shared_port;
+  uint32_t shared_id;
   int fs;
   int ps;
   int chan_num;
   int max_chan;
+  std::atomic_int active_speakers;
 
   odevice_ptr odevice;
+  std::atomic<MixSnapshot *> mix_snapshot;
+  std::atomic<MixSnapshot *> mix_hazard;
+  std::vector<std::unique_ptr<MixSnapshot>> mix_retired;
   std::mutex recv_mtx;
-  std::map<uint8_t, decoder_ptr> decoders;
-  std::map<uint8_t, sampler_ptr> samplers;
-  std::map<uint8_t, session_ptr> net_sessions;
-  std::map<uint8_t, session_ptr> loc_sessions;
-  asio::steady_timer timer;
-  usocket_ptr sock;
+  SessionTable<NetSession> net_sessions;
+  SessionTable<LocSession> loc_sessions;
+  std::chrono::milliseconds idle_timeout;
+  size_t max_sessions;
+  size_t session_pool_size;
+  bool session_full;
+  // evicted sessions are freed two sweeps later, once no snapshot or in-flight packet can reach them.
+  SessionSlots evicted;
+  SessionSlots evicted_prev;
+  // retired sessions waiting to be handed to the next sender, network slots fit any channel layout.
+  SessionSlots session_pool;
+  asio::steady_timer sweep_timer;
+  std::unique_ptr<asio::steady_timer> timer;
+  MediaClock clock;
+  int recv_shards;
+  bool recv_steering;
+  bool deep_redundancy;
+  std::vector<usocket_ptr> socks;
+  // set while a shard has a receive chain, which is what keeps it at one outstanding receive.
+  std::unique_ptr<std::atomic_bool[]> recv_armed;
   char *recv_buf;
   std::mutex delv_mtx;
   std::function<void(const int16_t *, int)> delv_cb;
@@ -105,12 +374,15 @@ class IAStreamImpl : public std::enable_shared_from_this<IAStreamImpl>
   friend class PhsyIADevice;
   friend class WaveIADevice;
   friend class MultiIADevice;
+  friend class NullIADevice;
   friend class PipeIADevice;
+  friend class AudioOfflineRenderImpl;
 
 public:
   IAStreamImpl(unsigned char _token, AudioBandWidth _bandwidth, AudioPeriodSize _period, const std::string &_hw_name,
-               bool _enable_network, bool _enable_reset);
-  IAStreamImpl(unsigned char _token, const std::shared_ptr<OAStreamImpl> &oas, bool _enable_network, bool _enable_reset);
+               bool _enable_network, bool _enable_reset, const AudioEncoderProfile &_profile);
+  IAStreamImpl(unsigned char _token, const std::shared_ptr<OAStreamImpl> &oas, bool _enable_network, bool _enable_reset,
+               const AudioEncoderProfile &_profile);
   ~IAStreamImpl();
 
   bool start();
@@ -123,25 +395,45 @@ public:
 
   void connect(const std::shared_ptr<OAStreamImpl> &sink);
 
-  bool connect(const std::string &ip, uint16_t port);
+  bool connect(const std::string &ip, uint16_t port, uint32_t dest_id = 0);
+
+  bool connect_shared(const std::string &ip, uint32_t stream_id);
+
+  void set_source_id(uint32_t id);
 
   void set_callback(AudioInputCallBack _cb, int _ps, void *_user_data);
 
+  void set_capture_handoff(bool enable);
+
+  void set_encoder_profile(const AudioEncoderProfile &profile);
+
   void set_destory_callback(std::function<void()> &&_cb);
 
 private:
   void reset_phsy_device();
 
+  bool handoff_pcm_frames(const int16_t *input, int frame_number);
+
+  void start_handoff();
+
+  void stop_handoff();
+
+  void exec_handoff_loop();
+
   void set_resampler_parameter(int fsi, int fso, int chan);
 
   void read_raw_frames(const int16_t *input, int frame_number);
 
   void read_pcm_frames(const int16_t *input, int frame_number);
 
+  void send_packet(const char *data, size_t size);
+
   void copy_pcm_frames();
 
   void exec_external_loop();
 
+  bool start_offline(AudioOfflineRenderImpl *render);
+
 private:
   const unsigned char token;
   bool enable_network;
@@ -158,16 +450,127 @@ private:
   sampler_ptr sampler;
   loc_endpoints loc_dests;
   net_endpoints net_dests;
+  std::vector<uint32_t> net_dest_ids;
 
   usocket_ptr sock;
   std::mutex dest_mtx;
   asio::steady_timer timer0;
-  asio::steady_timer timer1;
+  std::unique_ptr<asio::steady_timer> timer1;
+  MediaClock usr_clock;
+  MediaClock clock;
   AudioInputCallBack usr_cb;
   void *usr_data;
   int usr_ps;
   std::function<void()> dtor_cb;
   std::atomic_bool ias_ready;
+  AudioOfflineRenderImpl *offline;
+
+  bool enable_handoff;
+  std::unique_ptr<SpscRing> handoff_ring;
+  std::vector<int16_t> handoff_buf;
+  std::thread handoff_thd;
+  std::atomic_bool handoff_running;
+  std::unique_ptr<WakeSignal> handoff_wake;
+};
+
+class AudioOfflineRenderImpl
+{
+public:
+  AudioOfflineRenderImpl();
+  ~AudioOfflineRenderImpl();
+
+  bool add(const std::shared_ptr<IAStreamImpl> &ias);
+
+  bool add(const std::shared_ptr<OAStreamImpl> &oas);
+
+  bool render(int ms);
+
+  int64_t elapsed_ms() const;
+
+  // loopback transport, stands in for the socket of an offline input stream.
+  void deliver(const char *data, size_t len, const asio::ip::udp::endpoint &dest, uint32_t dest_id);
+
+private:
+  struct Input
+  {
+    std::shared_ptr<IAStreamImpl> stream;
+    bool live;
+  };
+
+  std::chrono::steady_clock::time_point origin;
+  std::chrono::steady_clock::time_point now;
+  std::vector<Input> inputs;
+  std::vector<std::shared_ptr<OAStreamImpl>> outputs;
+  std::vector<char> scratch;
+};
+
+struct RelaySubscriber
+{
+  int id;
+  asio::ip::udp::endpoint dest;
+  uint32_t dest_id;
+  bool shared;
+  std::vector<uint32_t> senders;
+};
+
+struct RelayRoute
+{
+  // every subscriber takes extended packets, legacy ones skip the shared port subscribers.
+  net_endpoints dests;
+  std::vector<uint32_t> dest_ids;
+  net_endpoints legacy_dests;
+};
+
+// rebuilt on every subscription change and swapped in whole, the forwarding path only reads it.
+struct RelayRoutes
+{
+  RelayRoute unfiltered;
+  std::map<uint32_t, RelayRoute> filtered;
+
+  // a sender named by some filter also reaches every unfiltered subscriber.
+  static std::unique_ptr<RelayRoutes> build(const std::vector<RelaySubscriber> &subscribers);
+
+  const RelayRoute &find(uint32_t sender) const;
+};
+
+class AudioRelayImpl : public std::enable_shared_from_this<AudioRelayImpl>
+{
+public:
+  AudioRelayImpl(unsigned char _token, int _shards);
+  ~AudioRelayImpl();
+
+  bool start();
+
+  void stop();
+
+  int connect(const std::string &ip, uint16_t port, uint32_t dest_id, bool shared);
+
+  void disconnect(int subscriber);
+
+  void set_filter(int subscriber, const std::vector<uint32_t> &senders);
+
+private:
+  void do_receive(size_t shard);
+
+  void forward_packet(size_t shard, const char *data, size_t bytes);
+
+  void publish_routes();
+
+private:
+  const unsigned char token;
+  int recv_shards;
+  std::vector<usocket_ptr> socks;
+  char *recv_buf;
+  std::atomic_bool relay_ready;
+
+  std::mutex ctl_mtx;
+  std::vector<RelaySubscriber> subscribers;
+  int next_subscriber;
+  // published like the mix snapshot of OAStreamImpl, with one hazard pointer per shard since every shard
+  // has a single receive chain. retired tables are reclaimed under ctl_mtx once no hazard points at them.
+  std::atomic<const RelayRoutes *> routes;
+  std::unique_ptr<std::atomic<const RelayRoutes *>[]> route_hazards;
+  std::vector<std::unique_ptr<const RelayRoutes>> routes_retired;
 };
 
 class AudioPlayerImpl
@@ -191,7 +594,8 @@ private:
       return false;
     }
     auto audio_sender = std::make_shared<IAStreamImpl>(token + preemptive, AudioBandWidth::Full,
-                                                       AudioPeriodSize::INR_20MS, name, false, false);
+                                                       AudioPeriodSize::INR_20MS, name, false, false,
+                                                       AudioEncoderProfile());
     preemptive++;
     {
       std::lock_guard<std::mutex> grd(mtx);
@@ -226,4 +630,5 @@ private:
 };
 
 #define SERVICE (AudioService::GetService().executor())
+#define BULK_SERVICE (AudioService::GetService().bulk_executor())
 #endif
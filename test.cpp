@@ -1,10 +1,28 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <fstream>
+#include <map>
 #include <vector>
 #include <string>
 
+#include "src/audio_network.h"
 #include "src/audio_process.h"
+#include "src/audio_stream.h"
 
-int main(int argc, char **argv)
+static int failures = 0;
+
+#define TEST_CHECK(cond)                                                 \
+    do                                                                   \
+    {                                                                    \
+        if (!(cond))                                                     \
+        {                                                                \
+            printf("[FAIL] %s(%d): %s\n", __FUNCTION__, __LINE__, #cond); \
+            failures++;                                                  \
+        }                                                                \
+    } while (0)
+
+static void test_resampler()
 {
     std::vector<double> data_in, data_out;
     std::ifstream ifs("test_signals.txt");
@@ -15,10 +33,14 @@ int main(int argc, char **argv)
         data_in.emplace_back(std::stod(line));
     }
 
+    if (data_in.empty())
+    {
+        return;
+    }
+
     int order = 64;
     double rt = 480.0 / 441.0;
     double cutoff = 0.91;
-    int fs = 48000;
     int precision = 10000;
 
     int n_input = data_in.size();
@@ -36,5 +58,521 @@ int main(int argc, char **argv)
     {
         ofs << i << "\n";
     }
-    return 0;
-}
\ No newline at end of file
+}
+
+static std::vector<int16_t> play_packets(int fs, int ps, const std::vector<std::pair<uint32_t, size_t>> &packets,
+                                         size_t per_period)
+{
+    // every packet carries its sequence as the sample value, playout has to come out in sequence order.
+    JitterBuffer jb(fs, ps, 1);
+    std::vector<int16_t> pcm, played;
+    for (size_t i = 0; i < packets.size() + 8 * per_period; i += per_period)
+    {
+        for (size_t n = i; n < std::min(i + per_period, packets.size()); n++)
+        {
+            pcm.assign(packets[n].second, (int16_t)packets[n].first);
+            jb.store_data(packets[n].first, (const char *)pcm.data(), pcm.size() * sizeof(int16_t));
+        }
+        jb.load_data(ps * sizeof(int16_t));
+        auto out = (const int16_t *)jb.out_buf;
+        played.insert(played.end(), out, out + ps);
+    }
+    return played;
+}
+
+static bool played_in_order(const std::vector<int16_t> &played, int16_t last)
+{
+    // leading silence while the buffer primes, then no gap and no step backwards until the last packet.
+    auto it = std::find_if(played.begin(), played.end(), [](int16_t v)
+                           { return v != 0; });
+    if (it == played.end() || *it != 1)
+    {
+        return false;
+    }
+    for (; it + 1 != played.end() && *it != last; ++it)
+    {
+        if (it[1] < it[0])
+        {
+            return false;
+        }
+    }
+    return *it == last;
+}
+
+static void test_jitter_buffer()
+{
+    // swapped pairs and duplicates, two 10 ms packets per period. the tail below one period stays buffered.
+    std::vector<std::pair<uint32_t, size_t>> packets;
+    for (uint32_t seq = 1; seq <= 40; seq += 2)
+    {
+        packets.emplace_back(seq + 1, 480);
+        packets.emplace_back(seq, 480);
+        packets.emplace_back(seq, 480);
+    }
+    TEST_CHECK(played_in_order(play_packets(48000, 960, packets, 3), 38));
+
+    // 5 ms packets resampled to 44.1 khz alternate between 220 and 221 frames.
+    packets.clear();
+    for (uint32_t seq = 1; seq <= 80; seq++)
+    {
+        packets.emplace_back(seq, seq % 2 ? 220 : 221);
+    }
+    TEST_CHECK(played_in_order(play_packets(44100, 441, packets, 2), 79));
+
+    // 120 ms packets arrive every twelfth period and have to play out without gaps.
+    JitterBuffer jb(48000, 480, 1);
+    std::vector<int16_t> pcm, played;
+    for (uint32_t n = 0; n < 12 * 12; n++)
+    {
+        if (n % 12 == 0)
+        {
+            pcm.assign(5760, (int16_t)(n / 12 + 1));
+            jb.store_data(n / 12 + 1, (const char *)pcm.data(), pcm.size() * sizeof(int16_t));
+        }
+        jb.load_data(480 * sizeof(int16_t));
+        auto out = (const int16_t *)jb.out_buf;
+        played.insert(played.end(), out, out + 480);
+    }
+    TEST_CHECK(played_in_order(played, 10));
+}
+
+static void test_spsc_ring()
+{
+    // 13 samples per record never divide 16, so records straddle the end of the ring.
+    SpscRing ring(16);
+    int16_t head[3], data[10], out[10];
+    for (int16_t round = 0; round < 50; round++)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            head[i] = round;
+        }
+        for (int i = 0; i < 10; i++)
+        {
+            data[i] = (int16_t)(round * 10 + i);
+        }
+        TEST_CHECK(ring.push(head, 3, data, 10));
+        TEST_CHECK(!ring.push(head, 3, data, 10));
+        TEST_CHECK(ring.size() == 13);
+        TEST_CHECK(ring.pop(out, 3) && out[0] == round && out[2] == round);
+        TEST_CHECK(ring.pop(out, 10) && std::memcmp(out, data, sizeof(data)) == 0);
+        TEST_CHECK(!ring.pop(out, 1));
+    }
+}
+
+static int16_t clamp_sum(int32_t v)
+{
+    return (int16_t)std::min(32767, std::max(-32768, v));
+}
+
+static void test_mix_channels()
+{
+    // the dispatched kernel is compared with a scalar reference, every length up to 70 exercises the vector tails.
+    printf("mix kernel: %s\n", mix_channels_kernel());
+    uint32_t state = 1;
+    auto next = [&state]()
+    {
+        state = state * 1664525u + 1013904223u;
+        // a quarter of the samples sit at full scale so that sums saturate.
+        auto v = (int16_t)(state >> 16);
+        return (state & 0xc000) == 0 ? (int16_t)(v < 0 ? -32768 : 32767) : v;
+    };
+
+    const int shapes[][2] = {{1, 1}, {2, 2}, {1, 2}, {2, 1}};
+    for (auto &shape : shapes)
+    {
+        auto out_chan = shape[0], ssrc_chan = shape[1];
+        for (int frames = 1; frames <= 70; frames++)
+        {
+            std::vector<int16_t> ssrc(frames * ssrc_chan), output(frames * out_chan);
+            std::generate(ssrc.begin(), ssrc.end(), next);
+            std::generate(output.begin(), output.end(), next);
+            auto expected = output;
+            for (int i = 0; i < frames; i++)
+            {
+                for (int c = 0; c < out_chan; c++)
+                {
+                    int32_t v = ssrc_chan == out_chan ? ssrc[i * ssrc_chan + c]
+                                : ssrc_chan == 1     ? ssrc[i]
+                                                     : ((int32_t)ssrc[2 * i] + ssrc[2 * i + 1]) / 2;
+                    expected[i * out_chan + c] = clamp_sum(expected[i * out_chan + c] + v);
+                }
+            }
+            mix_channels(ssrc.data(), out_chan, ssrc_chan, frames, output.data());
+            TEST_CHECK(output == expected);
+        }
+    }
+}
+
+static void test_polyphase_resampler()
+{
+    // one second of stereo at 48 khz in 10 ms chunks comes out as 44.1 khz, one frame per chunk either way.
+    std::vector<int16_t> input(48000 * 2);
+    for (size_t i = 0; i < input.size() / 2; i++)
+    {
+        input[2 * i] = (int16_t)(8000 * std::sin(2 * 3.14159265358979 * 440 * i / 48000.0));
+        input[2 * i + 1] = (int16_t)(8000 * std::sin(2 * 3.14159265358979 * 1000 * i / 48000.0));
+    }
+
+    PolyphaseResampler chunked(48000, 44100, 2, 480);
+    std::vector<int16_t> out0, out1, buf(chunked.max_output(4800) * 2);
+    for (size_t i = 0; i < 48000; i += 480)
+    {
+        auto frames = chunked.process(input.data() + i * 2, 480, buf.data());
+        TEST_CHECK(frames + 1 >= 441 && frames <= 442 && frames <= chunked.max_output(480));
+        out0.insert(out0.end(), buf.begin(), buf.begin() + frames * 2);
+    }
+    TEST_CHECK(out0.size() / 2 + 1 >= 44100 && out0.size() / 2 <= 44101);
+
+    // the phase carries across calls, so uneven chunks give the very same samples.
+    PolyphaseResampler uneven(48000, 44100, 2, 4800);
+    const size_t sizes[] = {1, 4799, 37, 3000, 2163};
+    for (size_t i = 0, n = 0; i < 48000; i += sizes[n++ % 5])
+    {
+        auto count = std::min(sizes[n % 5], 48000 - i);
+        auto frames = uneven.process(input.data() + i * 2, count, buf.data());
+        out1.insert(out1.end(), buf.begin(), buf.begin() + frames * 2);
+    }
+    TEST_CHECK(out0 == out1);
+}
+
+static void test_session_table()
+{
+    // a table held at its load limit has long probe chains, random erase and reinsert must keep every id reachable.
+    SessionTable<int> table;
+    std::map<uint32_t, int> model;
+    uint32_t state = 7;
+    int limited = 0;
+    for (int round = 0; round < 20000; round++)
+    {
+        state = state * 1664525u + 1013904223u;
+        // a narrow id range keeps the table near the limit, the stride spreads ids over the whole 32-bit space.
+        auto id = (state >> 8) % 700 * 6151u;
+        if ((state & 7) == 0 && !model.empty())
+        {
+            auto victim = model.lower_bound(id);
+            victim = victim == model.end() ? model.begin() : victim;
+            TEST_CHECK(table.erase(victim->first) == victim->second);
+            TEST_CHECK(!table.contains(victim->first));
+            model.erase(victim);
+        }
+        else if (model.count(id))
+        {
+            // inserting a live id hands back its slot.
+            auto slot = table.insert(id);
+            TEST_CHECK(slot && *slot == model[id]);
+        }
+        else if (auto slot = table.insert(id))
+        {
+            *slot = round;
+            model[id] = round;
+        }
+        else
+        {
+            TEST_CHECK(model.size() == SessionTable<int>::LIMIT);
+            limited++;
+        }
+
+        if (round % 1000 == 0)
+        {
+            for (auto &entry : model)
+            {
+                auto slot = table.find(entry.first);
+                TEST_CHECK(slot && *slot == entry.second);
+            }
+        }
+    }
+
+    TEST_CHECK(limited > 0);
+    TEST_CHECK(table.size() == model.size());
+    auto ids = table.ids();
+    std::sort(ids.begin(), ids.end());
+    TEST_CHECK(ids.size() == model.size() && std::equal(ids.begin(), ids.end(), model.begin(),
+                                                        [](uint64_t id, const std::pair<const uint32_t, int> &entry)
+                                                        { return id == entry.first; }));
+}
+
+static void test_packet_header()
+{
+    char full[sizeof(PacketHeader) + sizeof(PacketExtension) + 4] = {};
+    PacketHeader head{3, 1, cast_bandwidth_as_uint8(AudioBandWidth::Full), enum2val(AudioEncoderFormat::OPUS), 7, 0};
+    std::memcpy(full, &head, sizeof(head));
+    TEST_CHECK(PacketHeader::validate(full, sizeof(PacketHeader) + 4));
+    TEST_CHECK(!PacketHeader::compact(full));
+    TEST_CHECK(!PacketHeader::extended(full));
+    TEST_CHECK(!PacketHeader::validate(full, sizeof(CompactHeader)));
+    TEST_CHECK(PacketHeader::get_sequence(full, 0) == 7);
+    TEST_CHECK(PacketHeader::source(full) == 3);
+
+    // extended packets carry the source and destination ids after the header.
+    PacketExtension ext{0x12345678, 9};
+    full[3] |= 0x80;
+    std::memcpy(full + sizeof(PacketHeader), &ext, sizeof(ext));
+    TEST_CHECK(PacketHeader::extended(full));
+    TEST_CHECK(PacketHeader::validate(full, sizeof(full)));
+    TEST_CHECK(!PacketHeader::validate(full, sizeof(PacketHeader) + sizeof(PacketExtension) - 1));
+    TEST_CHECK(PacketHeader::length(full) == sizeof(PacketHeader) + sizeof(PacketExtension));
+    TEST_CHECK(PacketHeader::source(full) == 0x12345678);
+    TEST_CHECK(PacketHeader::destination(full) == 9);
+    PacketHeader::set_destination(full, 11);
+    TEST_CHECK(PacketHeader::destination(full) == 11);
+    full[1] = 3;
+    TEST_CHECK(!PacketHeader::validate(full, sizeof(full)));
+
+    // version bits 01 in the control byte, 48 khz, a single payload byte.
+    char compact[sizeof(CompactHeader) + sizeof(PacketExtension) + 1] = {};
+    CompactHeader chead{3, 0x58, 0x0001, 0};
+    std::memcpy(compact, &chead, sizeof(chead));
+    TEST_CHECK(PacketHeader::compact(compact));
+    TEST_CHECK(PacketHeader::validate(compact, sizeof(CompactHeader) + 1));
+    TEST_CHECK(!PacketHeader::validate(compact, sizeof(CompactHeader)));
+    TEST_CHECK(PacketHeader::length(compact) == sizeof(CompactHeader));
+    TEST_CHECK(PacketHeader::source(compact) == 3);
+
+    // extended compact packets need room for the source and destination ids.
+    compact[1] |= 0x20;
+    std::memcpy(compact + sizeof(CompactHeader), &ext, sizeof(ext));
+    TEST_CHECK(!PacketHeader::validate(compact, sizeof(CompactHeader) + 1));
+    TEST_CHECK(PacketHeader::validate(compact, sizeof(compact)));
+    TEST_CHECK(PacketHeader::source(compact) == 0x12345678);
+}
+
+static void test_media_clock()
+{
+    using std::chrono::milliseconds;
+    MediaClock clock;
+    auto t0 = std::chrono::steady_clock::now();
+    clock.reset(48000, 480, t0);
+    TEST_CHECK(clock.advance(t0) == 1);
+    TEST_CHECK(clock.advance(t0 + milliseconds(5)) == 0);
+    TEST_CHECK(clock.advance(t0 + milliseconds(35)) == 3);
+    TEST_CHECK(clock.deadline() == t0 + milliseconds(40));
+
+    // a stall longer than the catch-up limit restarts the timeline from the late wake-up.
+    auto t1 = t0 + milliseconds(1000);
+    TEST_CHECK(clock.advance(t1) == 8);
+    TEST_CHECK(clock.deadline() == t1 + milliseconds(10));
+    TEST_CHECK(clock.advance(t1 + milliseconds(5)) == 0);
+    TEST_CHECK(clock.advance(t1 + milliseconds(10)) == 1);
+}
+
+static std::vector<std::vector<char>> encode_tone(int count, const AudioEncoderProfile &profile)
+{
+    NetEncoder encoder(3, 1, 480, AudioBandWidth::Full, profile);
+    std::vector<std::vector<char>> packets;
+    int16_t pcm[480];
+    for (int n = 0; n < count; n++)
+    {
+        for (int i = 0; i < 480; i++)
+        {
+            pcm[i] = (int16_t)(8000 * std::sin(2 * 3.14159265358979 * 440 * (n * 480 + i) / 48000.0));
+        }
+        encoder.push((const char *)pcm, sizeof(pcm));
+        size_t len = 0;
+        for (auto *msg = &encoder.prepare(len); len > 0; msg = &encoder.prepare(len))
+        {
+            auto data = (const char *)msg->data().data();
+            packets.emplace_back(data, data + len);
+            msg->consume(len);
+        }
+    }
+    return packets;
+}
+
+static void test_packet_recovery()
+{
+    AudioEncoderProfile profile;
+    profile.application = AudioEncoderApplication::VoIP;
+    profile.inband_fec = true;
+    profile.packet_loss_perc = 20;
+    auto packets = encode_tone(140, profile);
+    TEST_CHECK(packets.size() == 140);
+    if (packets.size() != 140)
+    {
+        return;
+    }
+
+    const char *out = nullptr;
+    size_t out_len = 0;
+    uint32_t lost = 0;
+    NetDecoder decoder(3, 1, 48000);
+    for (int i = 0; i < 4; i++)
+    {
+        TEST_CHECK(!decoder.recover(packets[i].data(), packets[i].size(), 0, lost, out, out_len));
+        TEST_CHECK(decoder.commit(packets[i].data(), packets[i].size(), out, out_len));
+    }
+
+    // sequences start at 1. sequence 5 is lost, it comes back from in-band fec or concealment before 6 is decoded.
+    std::vector<uint32_t> filled;
+    auto &next = packets[5];
+    while (decoder.recover(next.data(), next.size(), 0, lost, out, out_len))
+    {
+        TEST_CHECK(out_len == 480 * sizeof(int16_t));
+        filled.push_back(lost);
+    }
+    TEST_CHECK(filled == std::vector<uint32_t>{5});
+    TEST_CHECK(decoder.commit(next.data(), next.size(), out, out_len));
+    TEST_CHECK(decoder.sequence() == 6);
+
+    // late packets never open a gap.
+    TEST_CHECK(!decoder.recover(packets[2].data(), packets[2].size(), 0, lost, out, out_len));
+
+    // a sender that starts over from sequence 1 is followed, its first loss is recovered again.
+    for (int i = 6; i < 140; i++)
+    {
+        TEST_CHECK(decoder.commit(packets[i].data(), packets[i].size(), out, out_len));
+    }
+    TEST_CHECK(decoder.commit(packets[0].data(), packets[0].size(), out, out_len));
+    TEST_CHECK(decoder.restarted());
+    TEST_CHECK(decoder.sequence() == 1);
+    TEST_CHECK(decoder.commit(packets[1].data(), packets[1].size(), out, out_len));
+    filled.clear();
+    while (decoder.recover(packets[3].data(), packets[3].size(), 0, lost, out, out_len))
+    {
+        filled.push_back(lost);
+    }
+    TEST_CHECK(filled == std::vector<uint32_t>{3});
+}
+
+static void test_recovery_bound()
+{
+    // deep redundancy reaches far back, recovery stops at the oldest sequence the playout can still use.
+    AudioEncoderProfile profile;
+    profile.application = AudioEncoderApplication::VoIP;
+    auto packets = encode_tone(12, profile);
+    TEST_CHECK(packets.size() == 12);
+    if (packets.size() != 12)
+    {
+        return;
+    }
+
+    const char *out = nullptr;
+    size_t out_len = 0;
+    uint32_t lost = 0;
+    NetDecoder decoder(3, 1, 48000);
+    for (int i = 0; i < 6; i++)
+    {
+        TEST_CHECK(decoder.commit(packets[i].data(), packets[i].size(), out, out_len));
+    }
+
+    // sequences 7 to 10 are lost, with 9 as the oldest playable sequence only 9 and 10 are rebuilt.
+    std::vector<uint32_t> filled;
+    auto &late = packets[10];
+    while (decoder.recover(late.data(), late.size(), 9, lost, out, out_len))
+    {
+        filled.push_back(lost);
+    }
+    TEST_CHECK((filled == std::vector<uint32_t>{9, 10}));
+    TEST_CHECK(decoder.commit(late.data(), late.size(), out, out_len));
+    TEST_CHECK(!decoder.recover(packets[8].data(), packets[8].size(), 0, lost, out, out_len));
+}
+
+static void test_compact_timeline()
+{
+    // 48 khz, the low 16 bits of the sequence and the 32-bit sample clock are extended across wraparound.
+    char compact[sizeof(CompactHeader) + 1] = {};
+    CompactHeader chead{3, 0x58, 0x0001, 0xfffffff0u};
+    std::memcpy(compact, &chead, sizeof(chead));
+    TEST_CHECK(PacketHeader::get_sequence(compact, 0xfffe) == 0x10001);
+    TEST_CHECK(PacketHeader::get_sequence(compact, 0x10000) == 0x10001);
+    TEST_CHECK(PacketHeader::get_timestamp(compact, 0) == 0xfffffff0ULL * 1000 / 48);
+    TEST_CHECK(PacketHeader::get_timestamp(compact, 0xffffff00ULL * 1000 / 48) == 0xfffffff0ULL * 1000 / 48);
+    TEST_CHECK(!PacketHeader::fec(compact));
+
+    chead.sequence = 0xffff;
+    chead.timestamp = 0x10;
+    chead.control |= 0x04;
+    std::memcpy(compact, &chead, sizeof(chead));
+    TEST_CHECK(PacketHeader::get_sequence(compact, 0x10001) == 0xffff);
+    TEST_CHECK(PacketHeader::get_sequence(compact, 0x2fffe) == 0x2ffff);
+    TEST_CHECK(PacketHeader::get_timestamp(compact, 0xfffffff0ULL * 1000 / 48) == 0x100000010ULL * 1000 / 48);
+    TEST_CHECK(PacketHeader::get_timestamp(compact, 0x100000000ULL * 1000 / 48) == 0x100000010ULL * 1000 / 48);
+    TEST_CHECK(PacketHeader::fec(compact));
+}
+
+static void test_relay_routes()
+{
+    using asio::ip::udp;
+    auto at = [](uint16_t port)
+    { return udp::endpoint(asio::ip::make_address_v4("127.0.0.1"), port); };
+    // a forwards everyone, b on a shared port only sender 5, c senders 5 and 7.
+    std::vector<RelaySubscriber> subscribers{
+        {0, at(1000), 0, false, {}},
+        {1, at(1001), 50, true, {5}},
+        {2, at(1002), 0, false, {5, 7}},
+    };
+    auto routes = RelayRoutes::build(subscribers);
+
+    auto &five = routes->find(5);
+    TEST_CHECK((five.dests == net_endpoints{at(1000), at(1001), at(1002)}));
+    TEST_CHECK((five.dest_ids == std::vector<uint32_t>{0, 50, 0}));
+    // legacy packets never go to shared port subscribers.
+    TEST_CHECK((five.legacy_dests == net_endpoints{at(1000), at(1002)}));
+
+    auto &seven = routes->find(7);
+    TEST_CHECK((seven.dests == net_endpoints{at(1000), at(1002)}));
+    TEST_CHECK((seven.legacy_dests == net_endpoints{at(1000), at(1002)}));
+
+    // senders no filter names only reach the unfiltered subscribers.
+    auto &other = routes->find(9);
+    TEST_CHECK((other.dests == net_endpoints{at(1000)}));
+    TEST_CHECK(&other == &routes->find(3));
+
+    TEST_CHECK(RelayRoutes::build({})->find(5).dests.empty());
+}
+
+static uint64_t render_tone(int ms, double &energy)
+{
+    // a tone is sent over the loopback transport of the render and mixed by a null output.
+    auto oas = std::make_shared<OAStreamImpl>(7, AudioBandWidth::Full, AudioPeriodSize::INR_10MS, "null", true);
+    auto ias = std::make_shared<IAStreamImpl>(3, AudioBandWidth::Full, AudioPeriodSize::INR_10MS, "tone:440", true,
+                                              false, AudioEncoderProfile());
+    // 0xcc00 + token is the port an output stream with that token listens on.
+    ias->connect("127.0.0.1", 0xcc07);
+
+    uint64_t hash = 14695981039346656037ULL;
+    energy = 0;
+    oas->set_callback([&](const int16_t *data, int frames)
+                      {
+        for (int i = 0; i < frames * 2; i++)
+        {
+            hash = (hash ^ (uint16_t)data[i]) * 1099511628211ULL;
+            energy += (double)data[i] * data[i];
+        } });
+
+    AudioOfflineRenderImpl render;
+    TEST_CHECK(render.add(oas));
+    TEST_CHECK(render.add(ias));
+    render.render(ms);
+    TEST_CHECK(render.elapsed_ms() == ms);
+    return hash;
+}
+
+static void test_offline_render()
+{
+    double energy0 = 0, energy1 = 0;
+    auto hash0 = render_tone(500, energy0);
+    auto hash1 = render_tone(500, energy1);
+    TEST_CHECK(energy0 > 0);
+    TEST_CHECK(hash0 == hash1);
+}
+
+int main(int argc, char **argv)
+{
+    test_resampler();
+    test_jitter_buffer();
+    test_spsc_ring();
+    test_mix_channels();
+    test_polyphase_resampler();
+    test_session_table();
+    test_packet_header();
+    test_media_clock();
+    test_packet_recovery();
+    test_recovery_bound();
+    test_compact_timeline();
+    test_relay_routes();
+    test_offline_render();
+
+    printf("%s, %d failed checks\n", failures ? "FAILED" : "passed", failures);
+    return failures ? 1 : 0;
+}
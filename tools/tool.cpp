@@ -350,20 +350,21 @@ void Observer::do_receive()
         {
             if (!ec && PacketHeader::validate(recv_buf, bytes))
             {
-                auto sender = recv_buf[0];
-                auto chan = recv_buf[1];
+                auto sender = PacketHeader::source(recv_buf);
+                auto chan = PacketHeader::channels(recv_buf);
                 std::lock_guard<std::mutex> grd(dest_mtx);
-                if (net_sessions.find(sender) == net_sessions.end())
+                auto slot = net_sessions.find(sender);
+                if (!slot && (slot = net_sessions.insert(sender)) != nullptr)
                 {
-                    decoders.insert({sender, std::make_unique<NetDecoder>(sender, chan, fs)});
-                    net_sessions.insert(
-                        {sender, std::make_unique<SessionData>(ps * chan * sizeof(int16_t), 18, chan)});
+                    slot->decoder = std::make_unique<NetDecoder>(sender, chan, fs);
+                    slot->buffer = std::make_unique<JitterBuffer>(fs, ps, chan);
                 }
                 const char *decode_data = nullptr;
                 size_t decode_length = 0;
-                if (decoders.at(sender)->commit(recv_buf, bytes, decode_data, decode_length))
+                if (slot && slot->decoder->commit(recv_buf, bytes, decode_data, decode_length))
                 {
-                    net_sessions.at(sender)->store_data(decode_data, decode_length);
+                    slot->buffer->update_jitter(slot->decoder->current_jitter());
+                    slot->buffer->store_data(slot->decoder->sequence(), decode_data, decode_length);
                 }
             }
             do_receive();
@@ -381,20 +382,20 @@ void Observer::fresh_graph()
     {
         std::lock_guard<std::mutex> grd(dest_mtx);
         ui_element->chlist = {"null"};
-        for (const auto &e : net_sessions)
+        for (auto id : net_sessions.ids())
         {
-            ui_element->chlist.push_back(std::to_string(e.first));
+            ui_element->chlist.push_back(std::to_string(id));
         }
         auto key = ui_element->chlist.at(ui_element->chn_selected);
         if (key != "null")
         {
-            auto s = net_sessions.find(std::stoi(key));
-            if (s != net_sessions.end())
+            auto s = net_sessions.find((uint32_t)std::stoul(key));
+            if (s)
             {
-                auto ichan = s->second->chan;
-                auto idata = (const int16_t *)s->second->out_buf;
+                auto ichan = s->buffer->chan;
+                auto idata = (const int16_t *)s->buffer->out_buf;
                 auto isize = ps * ichan * sizeof(int16_t);
-                s->second->load_data(isize);
+                s->buffer->load_data(isize);
                 std::lock_guard<std::mutex> grd2(fresh_mtx);
                 if (ui_element->recorded)
                 {
@@ -427,7 +428,7 @@ void Observer::fresh_graph()
                 default:
                     break;
                 }
-                ui_element->info = decoders.at(s->first)->statistic_info();
+                ui_element->info = s->decoder->statistic_info();
             }
         }
     }
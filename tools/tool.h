@@ -119,8 +119,7 @@ private:
     const int fs;
     const int ps;
 
-    std::map<uint8_t, decoder_ptr> decoders;
-    std::map<uint8_t, session_ptr> net_sessions;
+    SessionTable<NetSession> net_sessions;
     fresh_cb cb;
 
     UiElement *ui_element;